@@ -0,0 +1,183 @@
+#pragma once
+
+#ifndef _ALLOCATOR_H_
+#define _ALLOCATOR_H_
+
+#include <stdlib.h>
+#include <new>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace memory {
+
+	using namespace std;
+
+	// statistics of tensor buffers
+	struct Stats {
+		size_t current;// bytes in use
+		size_t peak;// high-water mark of current
+		size_t cached;// bytes kept for reuse
+		size_t n_allocs;// number of heap allocations
+	};
+
+	inline Stats& stats() {
+		static Stats s = { 0, 0, 0, 0 };
+		return s;
+	}
+
+	// calls of operator new, counted by its replacement in tensor.cpp. tensor
+	// buffers do not go through it, they are counted in n_allocs
+	inline atomic<size_t>& news() {
+		static atomic<size_t> n(0);
+		return n;
+	}
+
+	// guards the statistics and every pool, tensors are allocated and
+	// released from any thread
+	inline mutex& lock() {
+		static mutex m;
+		return m;
+	}
+
+	inline void reset_peak() {
+		lock_guard<mutex> guard(lock());
+		stats().peak = stats().current;
+	}
+
+	// released blocks by size, reused instead of going back to the heap.
+	// take and put are called with lock() held
+	class Pool {
+	private:
+		map<size_t, vector<char*>> blocks;
+		Pool(const Pool&);
+		Pool& operator=(const Pool&);
+	public:
+		Pool() {
+			lock();// constructed first, so the mutex outlives static pools
+		}
+		~Pool() {
+			trim();
+		}
+		char* take(size_t bytes) {
+			auto item = blocks.find(bytes);
+			if (item == blocks.end() || item->second.empty()) {
+				return nullptr;
+			}
+			char *block = item->second.back();
+			item->second.pop_back();
+			stats().cached -= bytes;
+			return block;
+		}
+		void put(char *block, size_t bytes) {
+			blocks[bytes].push_back(block);
+			stats().cached += bytes;
+		}
+		void trim() {
+			// return all cached blocks to the heap
+			lock_guard<mutex> guard(lock());
+			for (auto &item : blocks) {
+				for (char *block : item.second) {
+					free(block);
+					stats().cached -= item.first;
+				}
+				item.second.clear();
+			}
+		}
+	};
+
+	// the process-wide pool, used while caching is on
+	inline Pool& cache() {
+		static Pool pool;
+		return pool;
+	}
+
+	inline bool& caching() {
+		static bool enabled = false;
+		return enabled;
+	}
+
+	inline void trim() {
+		cache().trim();
+	}
+
+	inline void set_caching(bool enabled) {
+		caching() = enabled;
+		if (!enabled) {
+			trim();
+		}
+	}
+
+	// the pool of the calling thread, set by PoolScope
+	inline Pool*& active_pool() {
+		static thread_local Pool *pool = nullptr;
+		return pool;
+	}
+
+	// routes the allocations and releases of this thread through pool
+	// until it goes out of scope, e.g. the buffers of one inference plan
+	class PoolScope {
+	private:
+		Pool *previous;
+	public:
+		PoolScope(Pool &pool) : previous(active_pool()) {
+			active_pool() = &pool;
+		}
+		~PoolScope() {
+			active_pool() = previous;
+		}
+	};
+
+	// the size of each block is kept in a header in front of the data
+	const size_t HEADER = 16;
+
+	template<class T>
+	T* allocate(size_t n) {
+		size_t bytes = n * sizeof(T);
+		Pool *pool = active_pool();
+		char *block = nullptr;
+		{
+			lock_guard<mutex> guard(lock());
+			block = (pool != nullptr) ? pool->take(bytes) : cache().take(bytes);
+			Stats &s = stats();
+			if (block == nullptr) {
+				s.n_allocs++;
+			}
+			s.current += bytes;
+			if (s.current > s.peak) {
+				s.peak = s.current;
+			}
+		}
+		if (block == nullptr) {
+			block = (char*)malloc(bytes + HEADER);
+			if (block == nullptr) {
+				lock_guard<mutex> guard(lock());
+				stats().current -= bytes;
+				throw bad_alloc();
+			}
+			*(size_t*)block = bytes;
+		}
+		return (T*)(block + HEADER);
+	}
+
+	template<class T>
+	void release(T *data) {
+		char *block = (char*)data - HEADER;
+		size_t bytes = *(size_t*)block;
+		Pool *pool = active_pool();
+		lock_guard<mutex> guard(lock());
+		stats().current -= bytes;
+		if (pool != nullptr) {
+			pool->put(block, bytes);
+		}
+		else if (caching()) {
+			cache().put(block, bytes);
+		}
+		else {
+			free(block);
+		}
+	}
+}
+
+#endif // !_ALLOCATOR_H_
@@ -0,0 +1,122 @@
+#pragma once
+
+#ifndef _AUGMENT_H_
+#define _AUGMENT_H_
+
+#include <vector>
+
+#include "tensor.h"
+#include "rng.h"
+
+namespace augment {
+
+	using namespace std;
+	using namespace tensor;
+
+	// random augmentation of (frame, width, height, channel) samples, fused with
+	// the normalization. every sample draws from its own stream of the seed,
+	// so the result does not depend on the order or the thread it runs on
+	struct Augmentation {
+		int crop;// random shift of up to crop pixels, the border is zero padded
+		bool flip;// random flip along the height axis
+		bool rotate;// random multiple of 90 degrees, square samples only
+		double brightness;// added offset in [-brightness, brightness]
+		double contrast;// factor in [1 - contrast, 1 + contrast] around the sample mean
+		double mixup;// alpha of the Beta(alpha, alpha) mixing weight, 0 is off
+		double scale, shift;// normalization, value * scale + shift
+		Augmentation()
+			: crop(0), flip(false), rotate(false), brightness(0), contrast(0),
+			mixup(0), scale(1.0), shift(0) { ; }
+	};
+
+	template<class T>
+	void apply(Augmentation &aug, const T *src, T *dst, Shape &shape, uint64_t seed, uint64_t stream) {
+		// shape is the shape of one sample, src and dst do not overlap
+		rng::Generator gen(seed, stream);
+		int F = shape[1], W = shape[2], H = shape[3], C = shape[4];
+		int dx = aug.crop ? gen.randint(2 * aug.crop + 1) - aug.crop : 0;
+		int dy = aug.crop ? gen.randint(2 * aug.crop + 1) - aug.crop : 0;
+		bool flip = aug.flip && gen.uniform() < 0.5;
+		int turns = (aug.rotate && W == H) ? gen.randint(4) : 0;
+		double offset = aug.brightness ? gen.uniform(-aug.brightness, aug.brightness) : 0.0;
+		double factor = aug.contrast ? gen.uniform(1 - aug.contrast, 1 + aug.contrast) : 1.0;
+		double mean = 0;
+		if (aug.contrast) {
+			int n = F * W * H * C;
+			for (int i = 0; i < n; i++) {
+				mean += src[i];
+			}
+			mean /= n;
+		}
+		// value * a + b for every pixel inside the source
+		double a = factor * aug.scale;
+		double b = ((1 - factor) * mean + offset) * aug.scale + aug.shift;
+		for (int f = 0; f < F; f++) {
+			for (int i = 0; i < W; i++) {
+				for (int j = 0; j < H; j++) {
+					// output (i, j) -> rotated -> flipped -> shifted source position
+					int ri = i, rj = j;
+					for (int t = 0; t < turns; t++) {
+						int tmp = ri;
+						ri = W - 1 - rj;
+						rj = tmp;
+					}
+					if (flip) {
+						rj = H - 1 - rj;
+					}
+					int si = ri + dx, sj = rj + dy;
+					T *out = dst + (((size_t)f * W + i) * H + j) * C;
+					if (si < 0 || si >= W || sj < 0 || sj >= H) {
+						for (int c = 0; c < C; c++) {
+							out[c] = (T)aug.shift;
+						}
+						continue;
+					}
+					const T *in = src + (((size_t)f * W + si) * H + sj) * C;
+					for (int c = 0; c < C; c++) {
+						out[c] = (T)(in[c] * a + b);
+					}
+				}
+			}
+		}
+	}
+
+	inline double __beta_(rng::Generator &gen, double alpha) {
+		// Johnk's method, uniforms only, meant for the small alpha of mixup
+		for (int i = 0; i < 64; i++) {
+			double x = pow(gen.uniform(), 1.0 / alpha);
+			double y = pow(gen.uniform(), 1.0 / alpha);
+			if (x + y <= 1.0 && x + y > 0.0) {
+				return x / (x + y);
+			}
+		}
+		return 0.5;
+	}
+
+	template<class T>
+	void mixup(Augmentation &aug, vector<Tensor<T>> &batch, uint64_t seed, uint64_t stream) {
+		// sample i is mixed with sample n - 1 - i in every tensor of the batch
+		// (inputs and targets) with the same weight
+		if (aug.mixup <= 0 || batch.empty()) {
+			return;
+		}
+		int n = batch[0].getShape()[0];
+		rng::Generator gen(seed, stream);
+		for (int i = 0; i < n / 2; i++) {
+			int j = n - 1 - i;
+			T lambda = (T)__beta_(gen, aug.mixup);
+			for (Tensor<T> &tensor : batch) {
+				int length = (int)(tensor.length() / tensor.getShape()[0]);
+				T *x = tensor.getData() + (size_t)i * length;
+				T *y = tensor.getData() + (size_t)j * length;
+				for (int k = 0; k < length; k++) {
+					T xk = x[k], yk = y[k];
+					x[k] = lambda * xk + (1 - lambda) * yk;
+					y[k] = lambda * yk + (1 - lambda) * xk;
+				}
+			}
+		}
+	}
+}
+
+#endif // !_AUGMENT_H_
@@ -0,0 +1,232 @@
+#pragma once
+
+#ifndef _DATASET_H_
+#define _DATASET_H_
+
+#include <limits.h>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+
+#include "tensor.h"
+#include "mapping.h"
+#include "parser.h"
+#include "augment.h"
+
+namespace dataset {
+
+	using namespace std;
+	using namespace tensor;
+
+	// tensors sharing the sample axis, e.g. inputs and targets
+	template<class T>
+	class Dataset {
+	private:
+		vector<Tensor<T>*> tensors;
+		vector<unique_ptr<Tensor<T>>> loaded;// text files read into memory
+		vector<unique_ptr<memory::MappedTensor<T>>> mapped;// binary files used in place
+	public:
+		int add(Tensor<T> &tensor) {
+			// in-memory source, the tensor must outlive the dataset
+			tensors.push_back(&tensor);
+			return (int)tensors.size() - 1;
+		}
+		int load(string path, bool cache = false) {
+			// binary files are memory-mapped when they hold T in the native byte
+			// order and converted by Tensor::load otherwise, text files are parsed
+			// into memory (and saved as path.bin for the next run with cache).
+			// returns the index of the tensor, -1 if the file can not be read
+			ifstream in(path, ios::in | ios::binary);
+			if (!in.is_open()) {
+				printf("Dataset::load: can not open %s\n", path.c_str());
+				return -1;
+			}
+			char magic[4] = { 0 };
+			in.read(magic, 4);
+			bool binary = in.gcount() == 4 && memcmp(magic, FILE_MAGIC, 4) == 0;
+			in.close();
+			if (binary) {
+				unique_ptr<memory::MappedTensor<T>> file(new memory::MappedTensor<T>());
+				if (file->open(path, memory::RANDOM_ACCESS)) {
+					mapped.push_back(move(file));
+					return add(mapped.back()->getTensor());
+				}
+			}
+			unique_ptr<Tensor<T>> tensor(new Tensor<T>());
+			bool ok = binary ? tensor->load(path) : parser::load_text(path, *tensor, cache);
+			if (!ok) {
+				printf("Dataset::load: can not read %s\n", path.c_str());
+				return -1;
+			}
+			loaded.push_back(move(tensor));
+			return add(*loaded.back());
+		}
+		int size() {
+			// number of samples common to all tensors
+			int n = tensors.empty() ? 0 : INT_MAX;
+			for (Tensor<T> *tensor : tensors) {
+				n = min(n, tensor->getShape()[0]);
+			}
+			return n;
+		}
+		int count() { return (int)tensors.size(); }
+		Tensor<T>& get(int i) { return *tensors[i]; }
+	};
+
+	// mini-batches assembled by background threads into a ring of
+	// pre-allocated buffers, batch k goes to slot k % n_buffers
+	template<class T>
+	class Loader {
+	private:
+		Dataset<T> &data;
+		int batch_size, n_batches;// batches per epoch, the last partial batch is dropped
+		bool shuffle;
+		unsigned int seed;
+		vector<vector<Tensor<T>>> slots;// one tensor per dataset tensor in each slot
+		vector<long long> ready;// the batch held by each slot, -1 if none
+		vector<thread> workers;
+		mutex lock;
+		condition_variable filled, freed;
+		long long produced, consumed, current;
+		bool stopping;
+		double stall;// seconds next() waited for a batch
+		vector<Tensor<T>> none;// returned when there is no batch
+		int n_workers;// started by the first next()
+		augment::Augmentation *augmentation;
+		int augmented;// the dataset tensor the augmentation applies to
+
+		void __permutation_(int epoch, vector<int> &order) {
+			// the same for every worker, reshuffled each epoch
+			int n = data.size();
+			order.resize(n);
+			for (int i = 0; i < n; i++) {
+				order[i] = i;
+			}
+			if (shuffle) {
+				mt19937 engine(seed + epoch);
+				std::shuffle(order.begin(), order.end(), engine);
+			}
+		}
+		void __fill_(vector<Tensor<T>> &slot, long long k, vector<int> &order, int &order_epoch) {
+			int epoch = (int)(k / n_batches);
+			int first = (int)(k % n_batches) * batch_size;
+			if (epoch != order_epoch) {
+				__permutation_(epoch, order);
+				order_epoch = epoch;
+			}
+			for (int t = 0; t < data.count(); t++) {
+				Tensor<T> &source = data.get(t);
+				Shape shape = source.getShape();
+				int n = (int)(source.length() / shape[0]);// elements of a sample
+				const T *src = source.getData();
+				T *dst = slot[t].getData();
+				for (int i = 0; i < batch_size; i++) {
+					int index = order[first + i];
+					if (augmentation != nullptr && t == augmented) {
+						// one stream per (epoch, sample), independent of the worker
+						uint64_t stream = ((uint64_t)epoch << 32) | (uint32_t)index;
+						augment::apply(*augmentation, src + (size_t)index * n, dst + (size_t)i * n, shape, seed, stream);
+					}
+					else {
+						memcpy(dst + (size_t)i * n, src + (size_t)index * n, n * sizeof(T));
+					}
+				}
+			}
+			if (augmentation != nullptr) {
+				augment::mixup(*augmentation, slot, seed, (1ull << 63) | (uint64_t)k);
+			}
+		}
+		void __work_() {
+			vector<int> order;
+			int order_epoch = -1;
+			while (true) {
+				unique_lock<mutex> guard(lock);
+				long long k = produced++;
+				int s = (int)(k % slots.size());
+				// wait until batch k - n_buffers has been handed back
+				freed.wait(guard, [&] { return stopping || k < consumed + (long long)slots.size(); });
+				if (stopping) {
+					return;
+				}
+				guard.unlock();
+				__fill_(slots[s], k, order, order_epoch);
+				guard.lock();
+				ready[s] = k;
+				filled.notify_all();
+			}
+		}
+	public:
+		Loader(Dataset<T> &data, int batch_size, bool shuffle = true,
+			int n_workers = 2, int n_buffers = 4, unsigned int seed = 0)
+			: data(data), batch_size(min(batch_size, data.size())), shuffle(shuffle), seed(seed),
+			produced(0), consumed(0), current(-1), stopping(false), stall(0),
+			n_workers(max(1, n_workers)), augmentation(nullptr), augmented(0) {
+			n_batches = data.size() / max(1, this->batch_size);
+			if (n_batches == 0) {
+				printf("Loader: the dataset is empty\n");
+				return;
+			}
+			// every buffer is allocated once, before the workers start
+			slots.resize(max(2, n_buffers));
+			ready.assign(slots.size(), -1);
+			for (vector<Tensor<T>> &slot : slots) {
+				for (int t = 0; t < data.count(); t++) {
+					Shape shape = data.get(t).getShape();
+					shape.set(this->batch_size, 0);
+					slot.push_back(Tensor<T>(shape));
+				}
+			}
+		}
+		~Loader() {
+			{
+				lock_guard<mutex> guard(lock);
+				stopping = true;
+			}
+			freed.notify_all();
+			for (thread &worker : workers) {
+				worker.join();
+			}
+		}
+		vector<Tensor<T>>& next() {
+			// the next batch, valid until the following call to next()
+			if (slots.empty()) {
+				return none;
+			}
+			if (workers.empty()) {
+				for (int i = 0; i < n_workers; i++) {
+					workers.push_back(thread(&Loader::__work_, this));
+				}
+			}
+			unique_lock<mutex> guard(lock);
+			if (current >= 0) {
+				consumed++;
+				freed.notify_all();
+			}
+			current++;
+			int s = (int)(current % slots.size());
+			if (ready[s] != current) {
+				auto start = chrono::steady_clock::now();
+				filled.wait(guard, [&] { return ready[s] == current; });
+				stall += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			}
+			return slots[s];
+		}
+		void setAugmentation(augment::Augmentation &augmentation, int tensor = 0) {
+			// applied by the workers to the given dataset tensor, before the first next()
+			this->augmentation = &augmentation;
+			augmented = tensor;
+		}
+		int getBatchSize() { return batch_size; }
+		int getBatchesPerEpoch() { return n_batches; }
+		long long getBatches() { return current + 1; }
+		double getStallTime() { return stall; }
+	};
+}
+
+#endif // !_DATASET_H_
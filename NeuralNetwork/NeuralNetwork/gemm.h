@@ -0,0 +1,352 @@
+#pragma once
+
+#ifndef _GEMM_H_
+#define _GEMM_H_
+
+#include <stdint.h>
+#include <memory>
+#include <algorithm>
+
+#include "ranked.h"
+#include "parallel.h"
+
+namespace gemm {
+
+	using namespace std;
+	using ranked::Matrix;
+
+	// the register tile of the micro-kernel and the cache blocks, in elements:
+	// a (MC, KC) panel of op(a) and a (KC, NB) panel of op(b) stay in L2
+	const int MR = 4, NR = 8;
+	const int MC = 64, KC = 256, NC = 512;
+	const int NB = 64;// columns of op(b) packed at a time, a task runs up to NC
+
+	// tiny products skip the packing, their dims are at most SMALL (except the
+	// rows of a, and the inner dim of a^T * b up to SMALL_INNER)
+	const int SMALL = 32, SMALL_INNER = 4096;
+
+	inline bool& __small_enabled_() {
+		static bool enabled = true;
+		return enabled;
+	}
+
+	inline void set_small_kernels(bool enabled) {
+		// off sends every product through the packed kernel, for benchmarks
+		__small_enabled_() = enabled;
+	}
+
+	inline bool is_small(bool trans_a, int M, int N, int K) {
+		if (!__small_enabled_() || N > SMALL) {
+			return false;
+		}
+		return trans_a ? (M <= SMALL && K <= SMALL_INNER) : (K <= SMALL);
+	}
+
+	template<class T, class Acc>
+	void __pack_a_(bool trans, const T *a, int64_t lda, int i0, int mc, int k0, int kc, Acc *dst) {
+		// rows [i0, i0 + mc) and columns [k0, k0 + kc) of op(a) in slivers of MR
+		// rows, k-major inside a sliver and zero-padded to MR rows
+		for (int ir = 0; ir < mc; ir += MR) {
+			int mr = min(MR, mc - ir);
+			for (int k = 0; k < kc; k++) {
+				for (int i = 0; i < MR; i++) {
+					if (i >= mr) {
+						*dst++ = (Acc)0;
+					}
+					else if (trans) {
+						*dst++ = (Acc)a[(int64_t)(k0 + k) * lda + i0 + ir + i];
+					}
+					else {
+						*dst++ = (Acc)a[(int64_t)(i0 + ir + i) * lda + k0 + k];
+					}
+				}
+			}
+		}
+	}
+
+	template<class T, class Acc>
+	void __pack_b_(bool trans, const T *b, int64_t ldb, int k0, int kc, int j0, int nc, Acc *dst) {
+		// rows [k0, k0 + kc) and columns [j0, j0 + nc) of op(b) in slivers of NR
+		// columns, k-major inside a sliver and zero-padded to NR columns
+		for (int jr = 0; jr < nc; jr += NR) {
+			int nr = min(NR, nc - jr);
+			for (int k = 0; k < kc; k++) {
+				for (int j = 0; j < NR; j++) {
+					if (j >= nr) {
+						*dst++ = (Acc)0;
+					}
+					else if (trans) {
+						*dst++ = (Acc)b[(int64_t)(j0 + jr + j) * ldb + k0 + k];
+					}
+					else {
+						*dst++ = (Acc)b[(int64_t)(k0 + k) * ldb + j0 + jr + j];
+					}
+				}
+			}
+		}
+	}
+
+	template<class Acc>
+	struct Scratch {
+		Acc a[MC * KC];// packed panel of op(a)
+		Acc b[KC * NB];// packed panel of op(b)
+		Acc c[MC * NC];// running sums of the block of c over all panels
+	};
+
+	template<class Acc>
+	inline Scratch<Acc>& __scratch_() {
+		// allocated once per thread, so a product allocates nothing
+		static thread_local unique_ptr<Scratch<Acc>> scratch(new Scratch<Acc>());
+		return *scratch;
+	}
+
+	template<class Acc>
+	inline void __kernel_(int kc, const Acc *a, const Acc *b, Acc c[MR][NR]) {
+		// c = sliver of a * sliver of b, the MR x NR sums stay in registers
+		for (int k = 0; k < kc; k++, a += MR, b += NR) {
+			for (int i = 0; i < MR; i++) {
+				Acc v = a[i];
+				for (int j = 0; j < NR; j++) {
+					c[i][j] += v * b[j];
+				}
+			}
+		}
+	}
+
+	template<int NP, class T, class Acc, class Epilogue>
+	void __small_rows_(bool trans_b, int M, int N, int K, const T *a, int64_t lda,
+		const T *b, int64_t ldb, T *c, int64_t ldc, Epilogue &epilogue) {
+		// c = a * op(b) with K, N <= SMALL: op(b) is copied once into a (K, NP)
+		// block padded with zeros, each row of c is summed in NP registers
+		Acc w[SMALL][NP];
+		for (int k = 0; k < K; k++) {
+			for (int j = 0; j < NP; j++) {
+				if (j >= N) {
+					w[k][j] = (Acc)0;
+				}
+				else {
+					w[k][j] = (Acc)(trans_b ? b[(int64_t)j * ldb + k] : b[(int64_t)k * ldb + j]);
+				}
+			}
+		}
+		parallel::parallel_for(0, M, [&](int first, int last) {
+			for (int i = first; i < last; i++) {
+				const T *x = a + (int64_t)i * lda;
+				Acc sums[NP] = {};
+				for (int k = 0; k < K; k++) {
+					Acc v = (Acc)x[k];
+					for (int j = 0; j < NP; j++) {
+						sums[j] += v * w[k][j];
+					}
+				}
+				T *z = c + (int64_t)i * ldc;
+				for (int j = 0; j < N; j++) {
+					z[j] = epilogue(i, j, sums[j]);
+				}
+			}
+		}, 64);
+	}
+
+	template<int NP, class T, class Acc, class Epilogue>
+	void __small_outer_(bool trans_b, int M, int N, int K, const T *a, int64_t lda,
+		const T *b, int64_t ldb, T *c, int64_t ldc, Epilogue &epilogue) {
+		// c = a^T * op(b) with M, N <= SMALL, e.g. a weight gradient over a batch:
+		// one outer product of rows of a and op(b) per k into (M, NP) sums
+		Acc sums[SMALL][NP] = {};
+		Acc y[NP] = {};
+		for (int k = 0; k < K; k++) {
+			const T *x = a + (int64_t)k * lda;
+			for (int j = 0; j < N; j++) {
+				y[j] = (Acc)(trans_b ? b[(int64_t)j * ldb + k] : b[(int64_t)k * ldb + j]);
+			}
+			for (int i = 0; i < M; i++) {
+				Acc v = (Acc)x[i];
+				for (int j = 0; j < NP; j++) {
+					sums[i][j] += v * y[j];
+				}
+			}
+		}
+		for (int i = 0; i < M; i++) {
+			T *z = c + (int64_t)i * ldc;
+			for (int j = 0; j < N; j++) {
+				z[j] = epilogue(i, j, sums[i][j]);
+			}
+		}
+	}
+
+	template<int NP, class T, class Acc, class Epilogue>
+	void __small_(bool trans_a, bool trans_b, int M, int N, int K, const T *a, int64_t lda,
+		const T *b, int64_t ldb, T *c, int64_t ldc, Epilogue &epilogue) {
+		if (trans_a) {
+			__small_outer_<NP, T, Acc>(trans_b, M, N, K, a, lda, b, ldb, c, ldc, epilogue);
+		}
+		else {
+			__small_rows_<NP, T, Acc>(trans_b, M, N, K, a, lda, b, ldb, c, ldc, epilogue);
+		}
+	}
+
+	template<class T, class Acc, class Epilogue>
+	void small_gemm(bool trans_a, bool trans_b, int M, int N, int K, const T *a, int64_t lda,
+		const T *b, int64_t ldb, T *c, int64_t ldc, Epilogue epilogue) {
+		// c(i, j) = epilogue(i, j, sum) of a product accepted by is_small, the
+		// width of the register tile is fixed at compile time from N
+		if (N <= 4) {
+			__small_<4, T, Acc>(trans_a, trans_b, M, N, K, a, lda, b, ldb, c, ldc, epilogue);
+		}
+		else if (N <= 8) {
+			__small_<8, T, Acc>(trans_a, trans_b, M, N, K, a, lda, b, ldb, c, ldc, epilogue);
+		}
+		else if (N <= 16) {
+			__small_<16, T, Acc>(trans_a, trans_b, M, N, K, a, lda, b, ldb, c, ldc, epilogue);
+		}
+		else {
+			__small_<SMALL, T, Acc>(trans_a, trans_b, M, N, K, a, lda, b, ldb, c, ldc, epilogue);
+		}
+	}
+
+	template<class T, class Acc, class Epilogue>
+	void gemm(bool trans_a, bool trans_b, int M, int N, int K, T alpha, const T *a, int64_t lda,
+		const T *b, int64_t ldb, T beta, T *c, int64_t ldc, Epilogue epilogue) {
+		// c(M, N) = epilogue(i, j, alpha * op(a)(M, K) * op(b)(K, N) + beta * c), all
+		// row-major, op transposes when trans is set. the transposes are taken while
+		// packing so no transposed copy is built. sums are kept in Acc over the
+		// whole inner dim, the epilogue is applied when a block of c is written,
+		// and c is not read when beta is 0
+		if (M <= 0 || N <= 0) {
+			return;
+		}
+		Acc alpha_ = (Acc)alpha, beta_ = (Acc)beta;
+		if (K > 0 && is_small(trans_a, M, N, K)) {
+			small_gemm<T, Acc>(trans_a, trans_b, M, N, K, a, lda, b, ldb, c, ldc, [&](int i, int j, Acc value) {
+				value *= alpha_;
+				if (beta_ != 0) {
+					value += beta_ * (Acc)c[(int64_t)i * ldc + j];
+				}
+				return epilogue(i, j, value);
+			});
+			return;
+		}
+		if (K <= 0) {
+			for (int i = 0; i < M; i++) {
+				for (int j = 0; j < N; j++) {
+					T *z = c + (int64_t)i * ldc + j;
+					*z = epilogue(i, j, beta_ == 0 ? (Acc)0 : beta_ * (Acc)*z);
+				}
+			}
+			return;
+		}
+		// tasks of (MC, nc) blocks of c, nc up to NC and smaller when there are
+		// fewer tasks than threads. a task runs the whole inner dim: each panel
+		// of op(a) is packed once for nc columns, the sums stay in Acc and c is
+		// written once
+		int m_blocks = (M + MC - 1) / MC, nc = NC;
+		while (nc > NB && (int64_t)m_blocks * ((N + nc - 1) / nc) < parallel::num_threads()) {
+			nc /= 2;
+		}
+		int n_blocks = (N + nc - 1) / nc;
+		parallel::parallel_for(0, m_blocks * n_blocks, [&](int first, int last) {
+			Scratch<Acc> &scratch = __scratch_<Acc>();
+			int packed = -1;// row block in scratch.a, reused when K fits one panel
+			for (int t = first; t < last; t++) {
+				int ib = t / n_blocks, jb = t % n_blocks;
+				int ic = ib * MC, mc = min(MC, M - ic);
+				int jc = jb * nc, nc_ = min(nc, N - jc);
+				for (int pc = 0; pc < K; pc += KC) {
+					int kc = min(KC, K - pc);
+					if (K > KC || ib != packed) {
+						__pack_a_(trans_a, a, lda, ic, mc, pc, kc, scratch.a);
+						packed = ib;
+					}
+					for (int jp = 0; jp < nc_; jp += NB) {
+						int nb = min(NB, nc_ - jp);
+						__pack_b_(trans_b, b, ldb, pc, kc, jc + jp, nb, scratch.b);
+						for (int jr = 0; jr < nb; jr += NR) {
+							const Acc *pb = scratch.b + (int64_t)(jr / NR) * kc * NR;
+							for (int ir = 0; ir < mc; ir += MR) {
+								Acc sums[MR][NR] = {};
+								Acc *tile = scratch.c + ir * NC + jp + jr;
+								if (pc > 0) {
+									for (int i = 0; i < MR; i++) {
+										for (int j = 0; j < NR; j++) {
+											sums[i][j] = tile[i * NC + j];
+										}
+									}
+								}
+								__kernel_(kc, scratch.a + (int64_t)ir * kc, pb, sums);
+								for (int i = 0; i < MR; i++) {
+									for (int j = 0; j < NR; j++) {
+										tile[i * NC + j] = sums[i][j];
+									}
+								}
+							}
+						}
+					}
+				}
+				for (int i = 0; i < mc; i++) {
+					T *z = c + (int64_t)(ic + i) * ldc + jc;
+					const Acc *sums = scratch.c + i * NC;
+					for (int j = 0; j < nc_; j++) {
+						Acc value = alpha_ * sums[j];
+						if (beta_ != 0) {
+							value += beta_ * (Acc)z[j];
+						}
+						z[j] = epilogue(ic + i, jc + j, value);
+					}
+				}
+			}
+		}, 1);
+	}
+
+	template<class T, class Acc>
+	void gemm(bool trans_a, bool trans_b, int M, int N, int K, T alpha, const T *a, int64_t lda,
+		const T *b, int64_t ldb, T beta, T *c, int64_t ldc) {
+		gemm<T, Acc>(trans_a, trans_b, M, N, K, alpha, a, lda, b, ldb, beta, c, ldc,
+			[](int i, int j, Acc value) { return (T)value; });
+	}
+
+	template<class T, class Acc, class Epilogue>
+	void gemm_batched(int batch, const int64_t *offset_a, const int64_t *offset_b, int64_t stride_c,
+		bool trans_a, bool trans_b, int M, int N, int K, T alpha, const T *a, int64_t lda,
+		const T *b, int64_t ldb, T beta, T *c, int64_t ldc, Epilogue epilogue) {
+		// entry i: c + i * stride_c = alpha * op(a + offset_a[i]) * op(b + offset_b[i]) + beta * c,
+		// a broadcast operand repeats its offset. the epilogue sees the row i * M + r, the
+		// row of the stacked outputs. products with fewer tiles than threads run one
+		// entry per task, larger ones one after another with their tiles in parallel
+		int64_t tiles = (int64_t)((M + MC - 1) / MC) * ((N + NB - 1) / NB);
+		auto entry = [&](int i) {
+			gemm<T, Acc>(trans_a, trans_b, M, N, K, alpha, a + offset_a[i], lda,
+				b + offset_b[i], ldb, beta, c + i * stride_c, ldc, [&](int r, int j, Acc value) {
+				return epilogue(i * M + r, j, value);
+			});
+		};
+		if (batch > 1 && tiles < parallel::num_threads()) {
+			// the gemm of each entry is nested in the job and runs serially
+			parallel::parallel_for(0, batch, [&](int first, int last) {
+				for (int i = first; i < last; i++) {
+					entry(i);
+				}
+			}, 1);
+			return;
+		}
+		for (int i = 0; i < batch; i++) {
+			entry(i);
+		}
+	}
+
+	template<class T, class Acc, class Epilogue>
+	void gemm(const Matrix<T> &a, bool trans_a, const Matrix<T> &b, bool trans_b, T alpha, T beta,
+		const Matrix<T> &c, Epilogue epilogue) {
+		// the same on ranked views, the sizes are taken from a and b
+		int M = trans_a ? a.dim(1) : a.dim(0), K = trans_a ? a.dim(0) : a.dim(1);
+		int N = trans_b ? b.dim(0) : b.dim(1);
+		gemm<T, Acc>(trans_a, trans_b, M, N, K, alpha, a.getData(), a.stride(0),
+			b.getData(), b.stride(0), beta, c.getData(), c.stride(0), epilogue);
+	}
+
+	template<class T, class Acc>
+	void gemm(const Matrix<T> &a, bool trans_a, const Matrix<T> &b, bool trans_b, T alpha, T beta, const Matrix<T> &c) {
+		gemm<T, Acc>(a, trans_a, b, trans_b, alpha, beta, c, [](int i, int j, Acc value) { return (T)value; });
+	}
+}
+
+#endif // !_GEMM_H_
@@ -3,9 +3,16 @@
 #include <vector>
 #include <stdarg.h>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <stdexcept>
 
 #include "tensor.h"
 #include "ops.h"
+#include "optimizer.h"
+#include "dataset.h"
+#include "precision.h"
+#include "quantize.h"
 
 namespace AutoGrad {
 
@@ -14,18 +21,57 @@ namespace AutoGrad {
 
 	enum NodeType { VARIABLE, PLACEHOLDER, OPERATION };
 
+	enum Initializer { UNIFORM, ZEROS, XAVIER, HE };
+
 	template<class T>
 	class Node {
 	protected:
 		Shape m_Shape;
 		Tensor<T> m_Value;// every node has an output
+		Tensor<precision::half> m_Half;// mixed precision: the output stored in 16 bits until backward
+		Tensor<precision::bfloat16> m_BFloat16;
 		vector<Node*> m_Consumers;// the consumers of current node
 	public:
 		void setShape(Shape &shape) { m_Shape = shape; }
-		void setValue(Tensor<T> &value) { m_Value = value; }
+		void setValue(Tensor<T> &value) { m_Value = value; m_Half.clear(); m_BFloat16.clear(); }
+		void setValue(Tensor<T> &&value) { m_Value = move(value); m_Half.clear(); m_BFloat16.clear(); }
+		void bindValue(Tensor<T> &value) { m_Value.bind(value); }// no copy, value must outlive the run
 		void addConsumer(Node<T> *consumer) { m_Consumers.push_back(consumer); }
+		void replaceConsumer(Node<T> *from, Node<T> *to) {
+			replace(m_Consumers.begin(), m_Consumers.end(), from, to);
+		}
 		Shape getShape() { return m_Shape; }
-		Tensor<T> getValue() { return m_Value; }
+		Tensor<T>& getValue() { unpack(); return m_Value; }
+		bool hasValue() { return !m_Value.empty() || isPacked(); }
+		void release() { m_Value.clear(); m_Half.clear(); m_BFloat16.clear(); }
+		bool isPacked() { return !m_Half.empty() || !m_BFloat16.empty(); }
+		bool isView() { return m_Value.isView(); }
+		void pack(precision::Precision storage) {
+			// keep the output in 16 bits, lossless as it is already rounded to storage
+			if (m_Value.empty() || storage == precision::FP32) {
+				return;
+			}
+			if (storage == precision::FP16) {
+				m_Half = m_Value.template cast<precision::half>();
+			}
+			else {
+				m_BFloat16 = m_Value.template cast<precision::bfloat16>();
+			}
+			m_Value.clear();
+		}
+		void unpack() {
+			// widen a packed output for the bprop reading it, the 16-bit copy is kept
+			if (!m_Value.empty() || !isPacked()) {
+				return;
+			}
+			m_Value = m_Half.empty() ? m_BFloat16.template cast<T>() : m_Half.template cast<T>();
+		}
+		void drop() {
+			// free the widened copy of a packed output
+			if (isPacked()) {
+				m_Value.clear();
+			}
+		}
 		vector<Node*> getConsumers() { return m_Consumers; }
 		virtual NodeType getNodeType() = 0;
 	};
@@ -35,15 +81,49 @@ namespace AutoGrad {
 	private:
 		string m_Name;
 		bool m_RequireGrad;
+		Initializer m_Initializer;
+		Tensor<T> m_Master;// mixed precision: the weights updated by the optimizer
 	public:
-		Variable(string name, Shape shape, bool require_grad=true)
-			: m_Name(name), m_RequireGrad(require_grad) {
+		Variable(string name, Shape shape, bool require_grad=true, Initializer initializer=UNIFORM)
+			: m_Name(name), m_RequireGrad(require_grad), m_Initializer(initializer) {
 			m_Shape = shape;
 		}
 		virtual NodeType getNodeType() { return VARIABLE; }
 		bool isRequireGrad() { return m_RequireGrad; }
+		T* getData() { return m_Master.empty() ? m_Value.getData() : m_Master.getData(); }
+		void cast(precision::Precision storage) {
+			// the value read by forward, the master weights rounded to storage
+			if (m_Value.empty()) {
+				return;
+			}
+			if (storage == precision::FP32) {
+				if (!m_Master.empty()) {
+					m_Value = move(m_Master);
+					m_Master.clear();
+				}
+				return;
+			}
+			if (m_Master.empty()) {
+				m_Master = m_Value;
+			}
+			memcpy(m_Value.getData(), m_Master.getData(), m_Value.size());
+			precision::round(m_Value.getData(), m_Value.length(), storage);
+		}
 		void initialize() {
-			m_Value = Tensor<T>::random(m_Shape);
+			m_Master.clear();
+			// filters are (n_filters, frames, width, height, channels),
+			// matrices are (1, 1, 1, inputs, outputs)
+			int fan_in = m_Shape[3], fan_out = m_Shape[4];
+			if (m_Shape[0] > 1) {
+				fan_in = m_Shape[1] * m_Shape[2] * m_Shape[3] * m_Shape[4];
+				fan_out = m_Shape[0] * m_Shape[1] * m_Shape[2] * m_Shape[3];
+			}
+			switch (m_Initializer) {
+			case ZEROS: m_Value = Tensor<T>::zeros(m_Shape); break;
+			case XAVIER: m_Value = Tensor<T>::xavier(m_Shape, fan_in, fan_out); break;
+			case HE: m_Value = Tensor<T>::he(m_Shape, fan_in); break;
+			default: m_Value = Tensor<T>::random(m_Shape); break;
+			}
 		}
 	};
 
@@ -60,8 +140,9 @@ namespace AutoGrad {
 	class Operation : public Node<T> {
 	protected:
 		vector<Node<T>*> m_InputNodes; // only operation has inputs
-		void addWeight(string name, Shape &shape, bool trainable = true) {
-			Variable<T> *variable = new Variable<T>(name, shape, trainable);
+		bool m_Training = true;// false in inference mode
+		void addWeight(string name, Shape &shape, bool trainable = true, Initializer initializer = UNIFORM) {
+			Variable<T> *variable = new Variable<T>(name, shape, trainable, initializer);
 			m_InputNodes.push_back(variable);
 			variable->addConsumer(this);
 		}
@@ -74,20 +155,34 @@ namespace AutoGrad {
 				InputNode->addConsumer(this);
 			}
 		}
-		Tensor<T> getInput(int i) {
+		Tensor<T>& getInput(int i) {
 			return m_InputNodes[i]->getValue();
 		}
 		vector<Tensor<T>> getInputs() {
 			vector<Tensor<T>> inputs;
-			int n = m_InputNodes.size();
-			for (int i = 0; i < n;i++) {
-				Node<T>* InputNode = m_InputNodes[i];
-				inputs.push_back(InputNode->getValue());
-			};
+			getInputs(inputs);
 			return inputs;
 		}
+		void getInputs(vector<Tensor<T>> &inputs) {
+			// views of the input values, nothing is copied
+			int n = m_InputNodes.size();
+			inputs.resize(n);
+			for (int i = 0; i < n; i++) {
+				inputs[i].bind(m_InputNodes[i]->getValue());
+			}
+		}
 		vector<Node<T>*> getInputNodes() { return m_InputNodes; }
+		void replaceInput(Node<T> *from, Node<T> *to) {
+			replace(m_InputNodes.begin(), m_InputNodes.end(), from, to);
+		}
 		virtual NodeType getNodeType() { return OPERATION; }
+		void setTraining(bool training) { m_Training = training; }
+		virtual void reset() { ; }// before the forward pass of each training step
+		// what bprop reads besides D, the other activations are freed after forward
+		virtual bool savesInput(int i) { return true; }
+		virtual bool savesOutput() { return false; }
+		// true when the inference output may be a view of the first input
+		virtual bool viewsInput() { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) = 0; // forward output
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) = 0; // back propagation
 		virtual void build(Shape &shape) { ; }
@@ -100,9 +195,10 @@ namespace AutoGrad {
 	class Add : public Operation<T> {
 	public:
 		Add(Node<T>* x, Node<T> *y) :Operation<T>({ x, y }) { ; }
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
-			Tensor<T> y = inputs[1];
+			Tensor<T> &x = inputs[0];
+			Tensor<T> &y = inputs[1];
 			return x + y;
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
@@ -115,18 +211,31 @@ namespace AutoGrad {
 	public:
 		MatMul(Node<T>* x, Node<T> *y) : Operation<T>({ x, y }) { ; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
-			Tensor<T> y = inputs[1];
+			Tensor<T> &x = inputs[0];
+			Tensor<T> &y = inputs[1];
 			return x.matmul(y);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			vector<Tensor<T>> inputs = getInputs();
 			if (V == m_InputNodes[0])
-				return inputs[1].matmul(D);
+				return gradient(getInput(0), getInput(1), D, 0);
 			if (V == m_InputNodes[1])
-				return inputs[0].matmul(D);
+				return gradient(getInput(0), getInput(1), D, 1);
 			return D;
 		}
+		static Tensor<T> gradient(Tensor<T> &x, Tensor<T> &y, Tensor<T> &D, int input) {
+			// D * y^T (input 0) and x^T * D (input 1) per batch entry, the transposes
+			// are taken by the gemm packing. a broadcast operand gets the sum over the batch
+			if (!y.isBatched()) {
+				// a shared matrix, the rows of all entries in one product
+				return (input == 0) ? D.matmul(y, false, true) : x.matmul(D, true, false);
+			}
+			Tensor<T> grad = (input == 0) ? D.batch_matmul(y, false, true) : x.batch_matmul(D, true, false);
+			Shape shape_in = (input == 0) ? x.getShape() : y.getShape();
+			if (!(grad.getShape() == shape_in)) {
+				return grad.reduce_to(shape_in);
+			}
+			return grad;
+		}
 	};
 
 
@@ -140,12 +249,15 @@ namespace AutoGrad {
 		Convolution(Node<T> *x, int width, int padding, int stride, int n_filters)
 			: Operation<T>({ x }), width(width), padding(padding), stride(stride), n_filters(n_filters) {
 		}
+		int getWidth() { return width; }
+		int getPadding() { return padding; }
+		int getStride() { return stride; }
 		virtual void build(Shape &shape) {
 			// build weights
 			Shape filter_shape(n_filters, shape[1], width, width, shape[4]);
 			Shape bias_shape(1, 1, 1, 1, n_filters);
-			addWeight("filter", filter_shape);
-			addWeight("bias", bias_shape);
+			addWeight("filter", filter_shape, true, HE);
+			addWeight("bias", bias_shape, true, ZEROS);
 		}
 	};
 
@@ -167,20 +279,22 @@ namespace AutoGrad {
 			m_Shape = Shape(n_samples, n_frames, n_width, n_height, n_channels);
 		}
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
-			Tensor<T> filter = inputs[1];
-			Tensor<T> bias = inputs[2];
+			Tensor<T> &x = inputs[0];
+			Tensor<T> &filter = inputs[1];
+			Tensor<T> &bias = inputs[2];
 			return x.padding(padding).conv2d(filter, bias, stride);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			Tensor<T> x = getInput(0);
-			Tensor<T> filter = getInput(1);
-			Tensor<T> bias = getInput(2);
+			Tensor<T> &x = getInput(0);
+			Tensor<T> &filter = getInput(1);
+			Tensor<T> &bias = getInput(2);
 			// pass the delta to the flter and bias
+			Shape x_shape = x.getShape();
+			Shape filter_shape = filter.getShape();
 			if (V == m_InputNodes[0])
-				return D.padding(width).conv2d(filter.rotate180(), stride);
+				return D.conv2d_grad_input(filter, x_shape, stride, padding);
 			if (V == m_InputNodes[1])
-				return x.conv2d(D, stride);
+				return x.conv2d_grad_filter(D, filter_shape, stride, padding);
 			if (V == m_InputNodes[2])
 				return D.reduce_sum(0).reduce_sum(1).reduce_sum(2).reduce_sum(3);
 			return D;
@@ -208,14 +322,16 @@ namespace AutoGrad {
 			return inputs[0].padding(padding).conv2d(inputs[1], inputs[2], stride);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			Tensor<T> x = getInput(0);
-			Tensor<T> filter = getInput(1);
-			Tensor<T> bias = getInput(2);
+			Tensor<T> &x = getInput(0);
+			Tensor<T> &filter = getInput(1);
+			Tensor<T> &bias = getInput(2);
 			// pass the delta to the flter and bias
+			Shape x_shape = x.getShape();
+			Shape filter_shape = filter.getShape();
 			if (V == m_InputNodes[0])
-				return D.padding(width).conv2d(filter.rotate180(), stride);
+				return D.conv2d_grad_input(filter, x_shape, stride, padding);
 			if (V == m_InputNodes[1])
-				return x.conv2d(D, stride);
+				return x.conv2d_grad_filter(D, filter_shape, stride, padding);
 			if (V == m_InputNodes[2])
 				return D.reduce_sum(0).reduce_sum(1).reduce_sum(2).reduce_sum(3);
 			return D;
@@ -242,30 +358,41 @@ namespace AutoGrad {
 			int n_channels = shape[4];
 			m_Shape = Shape(n_samples, n_frames, n_width, n_height, n_channels);
 		}
+		int getWidth() { return width; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) = 0;
 	};
 
 	template<class T>
 	class MaxPooling : public Pooling<T> {
+	private:
+		vector<unsigned char> m_Argmax;// position of the max in each window
+		Shape m_InputShape;
 	public:
 		MaxPooling(Node<T> *x, int width) : Pooling<T>(x, width) { ; }
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			return inputs[0].max_pooling(width);
+			m_InputShape = inputs[0].getShape();
+			return inputs[0].max_pooling(width, m_Argmax);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			return D.upsampling(V->getValue(), width);
+			return D.unpooling(m_InputShape, width, m_Argmax);
 		}
 	};
 
 	template<class T>
 	class MinPooling : public Pooling<T> {
+	private:
+		vector<unsigned char> m_Argmin;
+		Shape m_InputShape;
 	public:
 		MinPooling(Node<T> *x, int width) : Pooling<T>(x, width) { ; }
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			return inputs[0].min_pooling(width);
+			m_InputShape = inputs[0].getShape();
+			return inputs[0].min_pooling(width, m_Argmin);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			return D.upsampling(V->getValue(), width);
+			return D.unpooling(m_InputShape, width, m_Argmin);
 		}
 	};
 
@@ -273,6 +400,7 @@ namespace AutoGrad {
 	class AvgPooling : public Pooling<T> {
 	public:
 		AvgPooling(Node<T> *x, int width) : Pooling<T>(x, width) { ; }
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
 			return inputs[0].avg_pooling(width);
 		}
@@ -315,8 +443,9 @@ namespace AutoGrad {
 			: Operation<T>({ x }) { 
 			setShape(shape);
 		}
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> input = inputs[0];
+			Tensor<T> &input = inputs[0];
 			return input.reshape(m_Shape);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
@@ -333,6 +462,7 @@ namespace AutoGrad {
 		virtual void build(Shape &shape) {
 			setShape(shape.flatten());
 		}
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
 			return inputs[0].flatten();
 		}
@@ -354,8 +484,8 @@ namespace AutoGrad {
 			// build weights
 			Shape weight_shape(1, 1, 1, shape[4], n_outputs);
 			Shape bias_shape(1, 1, 1, 1, n_outputs);
-			addWeight("weight", weight_shape, true);
-			addWeight("bias", bias_shape, true);
+			addWeight("weight", weight_shape, true, XAVIER);
+			addWeight("bias", bias_shape, true, ZEROS);
 			// calculate output shape
 			int n_samples = shape[0];
 			int n_frames = shape[1];
@@ -365,20 +495,20 @@ namespace AutoGrad {
 			m_Shape = Shape(n_samples, n_frames, n_width, n_height, n_channels);
 		}
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
-			Tensor<T> w = inputs[1];
-			Tensor<T> b = inputs[2];
-			return  x.matmul(w).add(b);
+			Tensor<T> &x = inputs[0];
+			Tensor<T> &w = inputs[1];
+			Tensor<T> &b = inputs[2];
+			return x.matmul(w, b, IDENTITY);// the bias is added in the gemm epilogue
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
 			// calculate the delta of the weight and bias
-			Tensor<T> x = getInput(0);
-			Tensor<T> w = getInput(1);
+			Tensor<T> &x = getInput(0);
+			Tensor<T> &w = getInput(1);
 			// update weight delta
 			if (V == m_InputNodes[0]) // x
-				return D.matmul(w.Transpose());
+				return D.matmul(w, false, true);
 			if (V == m_InputNodes[1]) // w
-				return x.Transpose().matmul(D);
+				return x.matmul(D, true, false);
 			if (V == m_InputNodes[2]) // b
 				return D.reduce_sum(0).reduce_sum(1).reduce_sum(2).reduce_sum(3);
 			return D;
@@ -399,27 +529,45 @@ namespace AutoGrad {
 	class Sigmoid : public Activation<T> {
 	public:
 		Sigmoid(Node<T> *x) : Activation<T>(x) { ; }
+		virtual bool savesInput(int i) { return false; }
+		virtual bool savesOutput() { return true; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
+			Tensor<T> &x = inputs[0];
 			return  x.sigmoid();
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			Tensor<T> y = this->getValue();
-			Tensor<T> e = Tensor<T>::ones(y.getShape());
-			return D * (y * (e - y));
+			return ops::grad_sigmoid(D, this->getValue());
+		}
+	};
+
+	template<class T>
+	class Tanh : public Activation<T> {
+	public:
+		Tanh(Node<T> *x) : Activation<T>(x) { ; }
+		virtual bool savesInput(int i) { return false; }
+		virtual bool savesOutput() { return true; }
+		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
+			Tensor<T> &x = inputs[0];
+			return x.tanh();
+		}
+		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
+			return ops::grad_tanh(D, this->getValue());
 		}
 	};
 
 	template<class T>
 	class ReLU : public Activation<T> {
+	private:
+		vector<uint64_t> m_Positive;// one bit per element, x > 0
 	public:
 		ReLU(Node<T> *x) : Activation<T>(x) { ; }
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
-			return x.relu();
+			Tensor<T> &x = inputs[0];
+			return ops::relu(x, m_Positive);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			return D * ops::grad_relu(V->getValue());
+			return ops::grad_relu(D, m_Positive);
 		}
 	};
 
@@ -433,7 +581,7 @@ namespace AutoGrad {
 		LeakyReLU(Node<T> *x, T max_value, T threshold, T negative_slop)
 			: Activation<T>(x), max_value(max_value), threshold(threshold), negative_slop(negative_slop) { ; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
+			Tensor<T> &x = inputs[0];
 			return x.relu(max_value, threshold, negative_slop);
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
@@ -445,8 +593,9 @@ namespace AutoGrad {
 	class Softmax : public Activation<T> {
 	public:
 		Softmax(Node<T> *x) : Activation<T>(x) { ; }
+		virtual bool savesInput(int i) { return false; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> x = inputs[0];
+			Tensor<T> &x = inputs[0];
 			return x.softmax();
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
@@ -454,14 +603,344 @@ namespace AutoGrad {
 		}
 	};
 
+	//----------------------------------------DROPOUT OPERATION------------------------
+	template<class T>
+	class Dropout : public Operation<T> {
+	private:
+		double rate;
+		vector<uint64_t> m_Mask;// one bit per element, 1 keeps it
+		bool m_MaskValid;// kept until the next step, so a recomputed forward matches
+		template<class Func>
+		void __apply_(Tensor<T> &x, Tensor<T> &out, Func func) {
+			// out = x * keep * scale, 64 elements per mask word. rate >= 1 drops everything
+			int64_t n = x.length();
+			T scale = (rate < 1) ? (T)(1.0 / (1.0 - rate)) : (T)0;
+			uint64_t keep = (rate < 1) ? ~0ull : 0;
+			const T *in = x.getData();
+			T *o = out.getData();
+			parallel::parallel_for(0, (int64_t)m_Mask.size(), [&](int64_t first, int64_t last) {
+				for (int64_t w = first; w < last; w++) {
+					uint64_t bits = func(w) & keep;
+					int64_t end = min(n, (int64_t)(w + 1) * 64);
+					for (int64_t i = (int64_t)w * 64; i < end; i++) {
+						o[i] = ((bits >> (i & 63)) & 1) ? in[i] * scale : 0;
+					}
+				}
+			}, 64);
+		}
+	public:
+		Dropout(Node<T> *x, double rate) 
+			: Operation<T>({ x }), rate(rate), m_MaskValid(false) {
+			m_Shape = x->getShape();
+		}
+		virtual void reset() {
+			m_MaskValid = false;
+		}
+		virtual bool savesInput(int i) { return false; }
+		virtual bool viewsInput() { return true; }
+		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
+			Tensor<T> &x = inputs[0];
+			if (!m_Training) {
+				Tensor<T> out;
+				out.bind(x);
+				return out;// inference: identity, nothing is copied
+			}
+			if (rate <= 0) {
+				return x;
+			}
+			Shape shape = x.getShape();
+			Tensor<T> out(shape);
+			m_Mask.resize((x.length() + 63) / 64);
+			if (m_MaskValid) {
+				__apply_(x, out, [&](int64_t w) { return m_Mask[w]; });
+				return out;
+			}
+			// generate the mask while applying it: word w uses blocks 16w .. 16w+15
+			uint64_t seed = rng::get_seed(), stream = rng::next_stream();
+			uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+			uint32_t threshold = (uint32_t)(min(rate, 1.0) * 4294967295.0);
+			__apply_(x, out, [&](int64_t w) {
+				uint32_t counter[4] = { 0, 0, (uint32_t)stream, (uint32_t)(stream >> 32) };
+				uint32_t block[4];
+				uint64_t bits = 0;
+				for (int b = 0; b < 16; b++) {
+					uint64_t index = (uint64_t)w * 16 + b;
+					counter[0] = (uint32_t)index;
+					counter[1] = (uint32_t)(index >> 32);
+					rng::philox(counter, key, block);
+					for (int k = 0; k < 4; k++) {
+						bits |= (uint64_t)(block[k] >= threshold) << (b * 4 + k);
+					}
+				}
+				m_Mask[w] = bits;
+				return bits;
+			});
+			m_MaskValid = true;
+			return out;
+		}
+		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
+			if (!m_Training || rate <= 0) {
+				return D;
+			}
+			Shape shape = D.getShape();
+			Tensor<T> out(shape);
+			__apply_(D, out, [&](int64_t w) { return m_Mask[w]; });
+			return out;
+		}
+	};
+
+	//----------------------------------------FUSED OPERATION--------------------------
+	template<class T>
+	class FusedOperation : public Operation<T> {
+	protected:
+		ActivationType activation;
+		Tensor<T> m_Delta;// D * f'(y), shared by the bprop of all inputs
+		bool m_DeltaValid;
+		virtual Tensor<T> delta(Tensor<T> &D) {
+			Tensor<T> &y = this->getValue();
+			return D.activation_grad(y, activation);
+		}
+	public:
+		FusedOperation(Operation<T> *op, ActivationType activation)
+			: Operation<T>({}), activation(activation), m_DeltaValid(false) {
+			// take over the inputs of op
+			for (Node<T>* InputNode : op->getInputNodes()) {
+				m_InputNodes.push_back(InputNode);
+				InputNode->replaceConsumer(op, this);
+			}
+			m_Shape = op->getShape();
+		}
+		virtual bool savesOutput() { return true; }
+		ActivationType getActivation() { return activation; }
+		Tensor<T>& getDelta(Tensor<T> &D) {
+			if (!m_DeltaValid) {
+				m_Delta = delta(D);
+				m_DeltaValid = true;
+			}
+			return m_Delta;
+		}
+	};
+
+	template<class T>
+	class FusedConv2D : public FusedOperation<T> {
+	private:
+		int width, padding, stride, pooling;
+		Shape m_ConvShape;// output shape before pooling
+		vector<unsigned char> m_Argmax;// position of the max in each pooling window
+	protected:
+		virtual Tensor<T> delta(Tensor<T> &D) {
+			Tensor<T> delta = FusedOperation<T>::delta(D);
+			if (pooling == 1) {
+				return delta;
+			}
+			// route the delta back to the argmax of each pooling window
+			return delta.unpooling(m_ConvShape, pooling, m_Argmax);
+		}
+	public:
+		FusedConv2D(Operation<T> *conv, int width, int padding, int stride,
+			ActivationType activation, int pooling = 1)
+			: FusedOperation<T>(conv, activation), width(width), padding(padding),
+			stride(stride), pooling(pooling) {
+			m_Shape.set(m_Shape[2] / pooling, 2);
+			m_Shape.set(m_Shape[3] / pooling, 3);
+		}
+		int getWidth() { return width; }
+		int getPadding() { return padding; }
+		int getStride() { return stride; }
+		int getPooling() { return pooling; }
+		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
+			m_DeltaValid = false;
+			Tensor<T> x = inputs[0].padding(padding);
+			Shape x_shape = x.getShape();
+			Shape filter_shape = inputs[1].getShape();
+			m_ConvShape = Shape(x_shape[0], x_shape[1], (x_shape[2] - filter_shape[2]) / stride + 1,
+				(x_shape[3] - filter_shape[3]) / stride + 1, filter_shape[0]);
+			return x.conv2d(inputs[1], inputs[2], stride, activation, pooling, m_Argmax);
+		}
+		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
+			Tensor<T> &x = getInput(0);
+			Tensor<T> &filter = getInput(1);
+			Tensor<T> &delta = getDelta(D);
+			// same as Conv2D::bprop with the fused delta
+			Shape x_shape = x.getShape();
+			Shape filter_shape = filter.getShape();
+			if (V == m_InputNodes[0])
+				return delta.conv2d_grad_input(filter, x_shape, stride, padding);
+			if (V == m_InputNodes[1])
+				return x.conv2d_grad_filter(delta, filter_shape, stride, padding);
+			if (V == m_InputNodes[2])
+				return delta.reduce_sum(0).reduce_sum(1).reduce_sum(2).reduce_sum(3);
+			return D;
+		}
+	};
+
+	template<class T>
+	class FusedFullyConnected : public FusedOperation<T> {
+	public:
+		FusedFullyConnected(Operation<T> *fc, ActivationType activation)
+			: FusedOperation<T>(fc, activation) { ; }
+		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
+			m_DeltaValid = false;
+			return inputs[0].matmul(inputs[1], inputs[2], activation);
+		}
+		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
+			Tensor<T> &x = getInput(0);
+			Tensor<T> &w = getInput(1);
+			Tensor<T> &delta = getDelta(D);
+			// same as FullyConnected::bprop with the fused delta
+			if (V == m_InputNodes[0]) // x
+				return delta.matmul(w, false, true);
+			if (V == m_InputNodes[1]) // w
+				return x.matmul(delta, true, false);
+			if (V == m_InputNodes[2]) // b
+				return delta.reduce_sum(0).reduce_sum(1).reduce_sum(2).reduce_sum(3);
+			return D;
+		}
+	};
+
+	template<class T>
+	class FusedMatMul : public FusedOperation<T> {
+	public:
+		FusedMatMul(Operation<T> *matmul, ActivationType activation)
+			: FusedOperation<T>(matmul, activation) { ; }
+		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
+			m_DeltaValid = false;
+			return inputs[0].matmul(inputs[1], Epilogue<T>(nullptr, activation));
+		}
+		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
+			// same as MatMul::bprop with the fused delta
+			Tensor<T> &delta = getDelta(D);
+			if (V == m_InputNodes[0])
+				return MatMul<T>::gradient(getInput(0), getInput(1), delta, 0);
+			if (V == m_InputNodes[1])
+				return MatMul<T>::gradient(getInput(0), getInput(1), delta, 1);
+			return D;
+		}
+	};
+
+	//----------------------------------------QUANTIZED OPERATION----------------------
+	// int8 replacements of (fused) conv2d/fully_connected for inference, the
+	// weights are quantized once from the current values of the variables
+	template<class T>
+	class QuantizedOperation : public Operation<T> {
+	protected:
+		ActivationType activation;
+		quantize::QuantParams m_Input;// of the input activation, from calibration
+		quantize::QuantizedWeights m_Weights;
+		vector<T> m_Bias;
+		vector<uint8_t> m_Quantized;// the quantized input, reused between calls
+	public:
+		QuantizedOperation(Operation<T> *op, ActivationType activation, quantize::Range &range)
+			: Operation<T>({}), activation(activation) {
+			// take over the inputs of op
+			for (Node<T>* InputNode : op->getInputNodes()) {
+				m_InputNodes.push_back(InputNode);
+				InputNode->replaceConsumer(op, this);
+			}
+			m_Shape = op->getShape();
+			m_Input = quantize::choose_params(range.min_value(), range.max_value());
+			Tensor<T> &bias = getInput(2);
+			m_Bias.assign(bias.getData(), bias.getData() + bias.length());
+		}
+		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
+			return D;// inference only
+		}
+	};
+
+	template<class T>
+	class QuantizedFullyConnected : public QuantizedOperation<T> {
+	public:
+		QuantizedFullyConnected(Operation<T> *fc, ActivationType activation, quantize::Range &range)
+			: QuantizedOperation<T>(fc, activation, range) {
+			// weight (1, 1, 1, inputs, outputs)
+			Tensor<T> &w = getInput(1);
+			Shape shape = w.getShape();
+			m_Weights.quantize(w.getData(), shape[4], shape[3], 1, shape[4]);
+		}
+		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
+			Tensor<T> &x = inputs[0];
+			Shape shape = x.getShape();
+			int k = shape[4];
+			int64_t m = x.length() / k;
+			Tensor<T> out(shape[0], shape[1], shape[2], shape[3], m_Weights.n);
+			quantize::quantize_rows(x.getData(), m, k, m_Input, m_Quantized);
+			quantize::gemm(m_Quantized, m, m_Input, m_Weights, m_Bias.data(), activation, out.getData());
+			return out;
+		}
+	};
+
+	template<class T>
+	class QuantizedConv2D : public QuantizedOperation<T> {
+	private:
+		int width, padding, stride, pooling;
+	public:
+		QuantizedConv2D(Operation<T> *conv, int width, int padding, int stride,
+			ActivationType activation, int pooling, quantize::Range &range)
+			: QuantizedOperation<T>(conv, activation, range), width(width), padding(padding),
+			stride(stride), pooling(pooling) {
+			// filter (n_filters, frames, width, width, channels), conv2d sums the frames
+			Tensor<T> &filter = getInput(1);
+			Shape shape = filter.getShape();
+			int k = shape[2] * shape[3] * shape[4];
+			vector<T> summed((size_t)shape[0] * k, 0);
+			const T *f = filter.getData();
+			for (int n = 0; n < shape[0]; n++) {
+				for (int j = 0; j < shape[1]; j++) {
+					for (int i = 0; i < k; i++) {
+						summed[(size_t)n * k + i] += f[((size_t)n * shape[1] + j) * k + i];
+					}
+				}
+			}
+			m_Weights.quantize(summed.data(), shape[0], k, k, 1);
+		}
+		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
+			Tensor<T> padded;
+			if (padding > 0) {
+				padded = inputs[0].padding(padding);
+			}
+			Tensor<T> &x = (padding > 0) ? padded : inputs[0];
+			Shape shape = x.getShape();
+			int W = (shape[2] - width) / stride + 1, H = (shape[3] - width) / stride + 1;
+			int64_t m = (int64_t)shape[0] * shape[1] * W * H;
+			Tensor<T> conv(shape[0], shape[1], W, H, m_Weights.n);
+			quantize::quantize_patches(x, width, stride, m_Input, m_Quantized);
+			if (pooling == 1) {
+				quantize::gemm(m_Quantized, m, m_Input, m_Weights, m_Bias.data(), activation, conv.getData());
+				return conv;
+			}
+			// max pooling before the activation, as FusedConv2D
+			quantize::gemm(m_Quantized, m, m_Input, m_Weights, m_Bias.data(), IDENTITY, conv.getData());
+			Tensor<T> out(shape[0], shape[1], W / pooling, H / pooling, m_Weights.n);
+			out.foreach_assign([&](int i, int j, int k, int l, int c) {
+				T value = conv.at(i, j, k * pooling, l * pooling, c);
+				for (int pk = 0; pk < pooling; pk++) {
+					for (int pl = 0; pl < pooling; pl++) {
+						value = max(value, conv.at(i, j, k * pooling + pk, l * pooling + pl, c));
+					}
+				}
+				return __activation_(value, activation);
+			});
+			return out;
+		}
+	};
+
 	//
 	template<class T>
 	class Loss : public Operation<T> {
+	protected:
+		T m_LossScale = 1;// mixed precision scales the gradient of the loss
+		Tensor<T> scaled(Tensor<T> grad) {
+			if (m_LossScale == 1) {
+				return grad;
+			}
+			return grad * m_LossScale;
+		}
 	public:
 		Loss(Node<T> *output, Node<T> *target) 
 			: Operation<T>({ output, target }) {
 			m_Shape = output->getShape();
 		}
+		void setLossScale(double scale) { m_LossScale = (T)scale; }
 	};
 
 	template<class T>
@@ -470,15 +949,15 @@ namespace AutoGrad {
 		MSE(Node<T> *output, Node<T> *target)
 			: Loss<T>(output, target) { ; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> y_ = inputs[0];
-			Tensor<T> y = inputs[1];
+			Tensor<T> &y_ = inputs[0];
+			Tensor<T> &y = inputs[1];
 			Tensor<T> error = (y_ - y).pow(2);
 			return error.reduce_mean();
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			Tensor<T> y_ = V->getValue();
-			Tensor<T> y = getInput(1);
-			return (y_ - y);
+			Tensor<T> &y_ = V->getValue();
+			Tensor<T> &y = getInput(1);
+			return scaled(y_ - y);
 		}
 	};
 
@@ -488,15 +967,15 @@ namespace AutoGrad {
 		CrossEntrpy(Node<T> *output, Node<T> *target) 
 			: Loss<T>(output, target) { ; }
 		virtual Tensor<T> forward(vector<Tensor<T>> &inputs) {
-			Tensor<T> y_ = inputs[0];
-			Tensor<T> y = inputs[1];
+			Tensor<T> &y_ = inputs[0];
+			Tensor<T> &y = inputs[1];
 			Tensor<T> error = ((T)0.0f - (y*y_.log() + ((T)1.0f - y)*((T)1.0f - y_).log()));
 			return error.reduce_mean();
 		}
 		virtual Tensor<T> bprop(Node<T>* V, Tensor<T> &D) {
-			Tensor<T> y_ = V->getValue();
-			Tensor<T> y = getInput(1);
-			return (y_ - y);
+			Tensor<T> &y_ = V->getValue();
+			Tensor<T> &y = getInput(1);
+			return scaled(y_ - y);
 		}
 	};
 
@@ -509,7 +988,127 @@ namespace AutoGrad {
 		vector<Variable<T>*> variables;
 		vector<Operation<T>*> operations;
 		map<Node<T>*, Tensor<T>> grad_table;
+		map<Node<T>*, Node<T>*> fused_table;// fused node -> fused operation
+		set<Node<T>*> absorbed;// outputs fusion no longer computes
+		set<Node<T>*> checkpoints;// activations kept for backward, empty to keep all
+		vector<Operation<T>*> inference;// operations needed by the fetches
+		vector<vector<Node<T>*>> release_plan;// activations freed after each inference operation
+		vector<Tensor<T>> input_views;// reused buffer of views of the inputs
+		bool compact;// free the activations no bprop reads right after forward
+		precision::Precision storage;// activations and gradients are rounded to it
+		precision::LossScaler scaler;
+		map<Operation<T>*, quantize::Range> calibration;// input ranges of the quantizable operations
+		int unmaterialized;// forward tensors per step the fused operations no longer write
 	protected:
+		static bool __quantizable_(Operation<T> *op) {
+			return dynamic_cast<FusedConv2D<T>*>(op) != nullptr || dynamic_cast<Conv2D<T>*>(op) != nullptr
+				|| dynamic_cast<FusedFullyConnected<T>*>(op) != nullptr || dynamic_cast<FullyConnected<T>*>(op) != nullptr;
+		}
+		bool __saved_(Node<T> *node) {
+			// true when a bprop reads the value of node
+			if (((Operation<T>*)node)->savesOutput()) {
+				return true;
+			}
+			for (Node<T>* consumer : node->getConsumers()) {
+				vector<Node<T>*> inputs = ((Operation<T>*)consumer)->getInputNodes();
+				for (size_t i = 0; i < inputs.size(); i++) {
+					if (inputs[i] == node && ((Operation<T>*)consumer)->savesInput(i)) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+		void __mark_needed_(Node<T> *node, set<Node<T>*> &needed) {
+			if (node->getNodeType() != OPERATION || needed.find(node) != needed.end()) {
+				return;
+			}
+			needed.insert(node);
+			for (Node<T>* input : ((Operation<T>*)node)->getInputNodes()) {
+				__mark_needed_(input, needed);
+			}
+		}
+		void __materialize_(Node<T> *node, vector<Node<T>*> &recomputed) {
+			// re-run the forward of a released operation from the nearest kept inputs
+			if (node->getNodeType() != OPERATION || node->hasValue()) {
+				return;
+			}
+			Operation<T>* operation = (Operation<T>*)node;
+			for (Node<T>* input : operation->getInputNodes()) {
+				__materialize_(input, recomputed);
+			}
+			operation->getInputs(input_views);
+			operation->setValue(operation->forward(input_views));
+			__round_(operation->getValue());
+			recomputed.push_back(node);
+		}
+		void __materialize_inputs_(Operation<T> *operation, vector<Node<T>*> &recomputed) {
+			// a kept operation still reads its released inputs in bprop
+			for (Node<T>* input : operation->getInputNodes()) {
+				__materialize_(input, recomputed);
+			}
+		}
+		void __round_(Tensor<T> &tensor) {
+			precision::round(tensor.getData(), tensor.length(), storage);
+		}
+		bool __viewed_(Node<T> *node) {
+			// true when a consumer output shares the buffer of node
+			for (Node<T>* consumer : node->getConsumers()) {
+				if (((Operation<T>*)consumer)->viewsInput() && consumer->isView()) {
+					return true;
+				}
+			}
+			return false;
+		}
+		void __drop_(Node<T> *consumer) {
+			// a bprop widens only its own packed operands, free them once it returned
+			consumer->drop();
+			for (Node<T>* input : ((Operation<T>*)consumer)->getInputNodes()) {
+				input->drop();
+			}
+		}
+		void __release_(vector<Node<T>*> &nodes) {
+			for (Node<T>* node : nodes) {
+				if (checkpoints.find(node) == checkpoints.end()) {
+					node->release();
+				}
+			}
+			nodes.clear();
+		}
+		void __build_grad_checkpointed_() {
+			// split the operations into segments ending at checkpoints
+			vector<vector<Operation<T>*>> segments(1);
+			for (Operation<T>* operation : operations) {
+				segments.back().push_back(operation);
+				if (checkpoints.find(operation) != checkpoints.end()) {
+					segments.push_back(vector<Operation<T>*>());
+				}
+			}
+			// backward segment by segment, only two segments are alive at a time
+			vector<Node<T>*> previous, current;
+			for (int s = (int)segments.size() - 1; s >= 0; s--) {
+				vector<Operation<T>*> &segment = segments[s];
+				for (int i = (int)segment.size() - 1; i >= 0; i--) {
+					Operation<T>* operation = segment[i];
+					// the bprops of operation and its consumers read their outputs and inputs
+					for (Node<T>* consumer : operation->getConsumers()) {
+						__materialize_(consumer, current);
+						__materialize_inputs_((Operation<T>*)consumer, current);
+					}
+					__materialize_(operation, current);
+					__materialize_inputs_(operation, current);
+					build_grad(grad_table, operation);
+					for (Node<T>* input : operation->getInputNodes()) {
+						if (input->getNodeType() == VARIABLE && ((Variable<T>*)input)->isRequireGrad()) {
+							build_grad(grad_table, input);
+						}
+					}
+				}
+				__release_(previous);
+				previous.swap(current);
+			}
+			__release_(previous);
+		}
 		Tensor<T> build_grad(map<Node<T>*, Tensor<T>> &grad_table, Node<T> *V) {
 
 			if (grad_table.find(V) != grad_table.end()) {
@@ -523,17 +1122,19 @@ namespace AutoGrad {
 				Tensor<T> D = build_grad(grad_table, consumer);
 				Tensor<T> gradient = ((Operation<T>*)consumer)->bprop(V, D);
 				gradients.push_back(gradient);
+				__drop_(consumer);
 			}
 
 			Tensor<T> zero = Tensor<T>::zeros(gradients[0].getShape());
 			Tensor<T> G = accumulate(gradients.begin(), gradients.end(), zero);
+			__round_(G);
 
 			grad_table[V] = G;// record the gradient of V
 
 			return G;
 		}
 	public:
-		Graph() { ; }
+		Graph() : compact(false), storage(precision::FP32), scaler(1.0, 0), unmaterialized(0) { ; }
 		~Graph() {
 			placeholders.clear();
 			variables.clear();
@@ -555,11 +1156,141 @@ namespace AutoGrad {
 				operations.push_back((Operation<T>*)root);
 			}
 		}
+		int fuse() {
+			// rewrite conv2d/fully_connected/matmul + bias + activation (+ max pooling)
+			// into single operations with an epilogue, returns the number of fused patterns
+			int n_fused = 0;
+			for (size_t i = 0; i < operations.size(); i++) {
+				Operation<T>* op = operations[i];
+				ActivationType activation;
+				if (dynamic_cast<ReLU<T>*>(op) != nullptr)
+					activation = RELU;
+				else if (dynamic_cast<Sigmoid<T>*>(op) != nullptr)
+					activation = SIGMOID;
+				else if (dynamic_cast<Tanh<T>*>(op) != nullptr)
+					activation = TANH;
+				else
+					continue;
+				Node<T>* input = op->getInputNodes()[0];
+				if (input->getConsumers().size() != 1) {
+					continue;// the raw output is used elsewhere
+				}
+				Operation<T>* last = op;
+				FusedOperation<T>* fused = nullptr;
+				Conv2D<T>* conv = dynamic_cast<Conv2D<T>*>(input);
+				FullyConnected<T>* fc = dynamic_cast<FullyConnected<T>*>(input);
+				MatMul<T>* matmul = dynamic_cast<MatMul<T>*>(input);
+				if (conv != nullptr) {
+					// max(relu(x)) == relu(max(x)), pool before the activation
+					int pooling = 1;
+					vector<Node<T>*> consumers = op->getConsumers();
+					if (activation == RELU && consumers.size() == 1) {
+						MaxPooling<T>* pool = dynamic_cast<MaxPooling<T>*>(consumers[0]);
+						if (pool != nullptr) {
+							pooling = pool->getWidth();
+							last = pool;
+						}
+					}
+					fused = new FusedConv2D<T>(conv, conv->getWidth(), conv->getPadding(),
+						conv->getStride(), activation, pooling);
+				}
+				else if (fc != nullptr) {
+					fused = new FusedFullyConnected<T>(fc, activation);
+				}
+				else if (matmul != nullptr) {
+					fused = new FusedMatMul<T>(matmul, activation);
+				}
+				else {
+					continue;
+				}
+				// redirect the consumers of the last fused operation
+				for (Node<T>* consumer : last->getConsumers()) {
+					((Operation<T>*)consumer)->replaceInput(last, fused);
+					fused->addConsumer(consumer);
+				}
+				// keep the topological order, the fused operation takes the place of the last one
+				replace(operations.begin(), operations.end(), last, fused);
+				operations.erase(remove(operations.begin(), operations.end(), (Operation<T>*)input), operations.end());
+				operations.erase(remove(operations.begin(), operations.end(), op), operations.end());
+				fused_table[last] = fused;
+				absorbed.insert(input);
+				if (last != op) {
+					absorbed.insert(op);// the activation before pooling
+				}
+				i = find(operations.begin(), operations.end(), fused) - operations.begin();
+				// the output of conv2d/fully_connected/matmul, and of the activation when pooled
+				unmaterialized += (last == op) ? 1 : 2;
+				n_fused++;
+			}
+			return n_fused;
+		}
+		void calibrate() {
+			// one inference-mode forward over the bound inputs, recording the range
+			// of the input of each quantizable operation; call once per batch
+			set_training(false);
+			for (Operation<T>* operation : operations) {
+				operation->getInputs(input_views);
+				if (__quantizable_(operation)) {
+					Tensor<T> &x = input_views[0];
+					calibration[operation].observe(x.getData(), x.length(), x.getShape()[4]);
+				}
+				operation->setValue(operation->forward(input_views));
+			}
+		}
+		int quantize() {
+			// replace the calibrated conv2d/fully_connected (fused or not) by int8
+			// operations for inference, returns the number of replaced operations
+			int n_quantized = 0;
+			for (size_t i = 0; i < operations.size(); i++) {
+				Operation<T>* op = operations[i];
+				if (!__quantizable_(op) || calibration.find(op) == calibration.end()) {
+					continue;
+				}
+				quantize::Range &range = calibration[op];
+				Operation<T>* quantized = nullptr;
+				if (FusedConv2D<T>* conv = dynamic_cast<FusedConv2D<T>*>(op)) {
+					quantized = new QuantizedConv2D<T>(conv, conv->getWidth(), conv->getPadding(),
+						conv->getStride(), conv->getActivation(), conv->getPooling(), range);
+				}
+				else if (Conv2D<T>* conv = dynamic_cast<Conv2D<T>*>(op)) {
+					quantized = new QuantizedConv2D<T>(conv, conv->getWidth(), conv->getPadding(),
+						conv->getStride(), IDENTITY, 1, range);
+				}
+				else if (FusedFullyConnected<T>* fc = dynamic_cast<FusedFullyConnected<T>*>(op)) {
+					quantized = new QuantizedFullyConnected<T>(fc, fc->getActivation(), range);
+				}
+				else {
+					quantized = new QuantizedFullyConnected<T>(op, IDENTITY, range);
+				}
+				for (Node<T>* consumer : op->getConsumers()) {
+					((Operation<T>*)consumer)->replaceInput(op, quantized);
+					quantized->addConsumer(consumer);
+				}
+				operations[i] = quantized;
+				fused_table[op] = quantized;
+				calibration.erase(op);
+				n_quantized++;
+			}
+			return n_quantized;
+		}
+		int getUnmaterialized() { return unmaterialized; }
+		Node<T>* resolve(Node<T> *node) {
+			// the operation computing the value of node after fusion
+			if (absorbed.find(node) != absorbed.end()) {
+				throw invalid_argument("resolve: the node was fused away, create the session with fusion = false to fetch or checkpoint it");
+			}
+			while (fused_table.find(node) != fused_table.end()) {
+				node = fused_table[node];
+			}
+			return node;
+		}
 		void feed_dict(map<Placeholder<T>*, Tensor<T>*> &feed_dict) {
-			// initialize placaeholders
+			// bind placaeholders to the fed tensors, the tensors must outlive the run
 			for (Placeholder<T>* placeholder : placeholders) {
-				Tensor<T> tensor = *feed_dict[placeholder];
-				placeholder->setValue(tensor);
+				if (feed_dict.find(placeholder) == feed_dict.end()) {
+					continue;// not needed, e.g. the target in inference
+				}
+				placeholder->bindValue(*feed_dict[placeholder]);
 			}
 		}
 		void initialize_all_variables() {
@@ -568,20 +1299,142 @@ namespace AutoGrad {
 				variable->initialize();
 			}
 		}
+		void set_checkpoint(Node<T> *node) {
+			// keep the activation of node for backward
+			checkpoints.insert(resolve(node));
+		}
+		void auto_checkpoint(int every = 0) {
+			// keep every k-th activation, sqrt(N) segments by default.
+			// smaller k keeps more memory and recomputes less
+			int N = operations.size();
+			if (every <= 0) {
+				every = max(1, (int)sqrt((double)N));
+			}
+			for (int i = every - 1; i < N; i += every) {
+				checkpoints.insert(operations[i]);
+			}
+		}
+		void set_compact(bool compact) {
+			// false (default) keeps every activation until the next run, e.g. to fetch them
+			this->compact = compact;
+		}
+		void set_precision(precision::Precision storage, double loss_scale = 0) {
+			// mixed precision: forward and backward see values rounded to storage,
+			// the activations bprop reads are stored in 16 bits between forward and
+			// backward, the optimizer updates the full precision master weights. loss_scale 0
+			// is dynamic for FP16 and none for BF16, which has the range of float
+			this->storage = storage;
+			if (loss_scale > 0) {
+				scaler = precision::LossScaler(loss_scale, 0);
+			}
+			else {
+				scaler = (storage == precision::FP16) ? precision::LossScaler() : precision::LossScaler(1.0, 0);
+			}
+		}
+		void set_training(bool training) {
+			// inference mode turns off training-only operations such as dropout
+			for (Operation<T>* operation : operations) {
+				operation->setTraining(training);
+			}
+		}
 		void run() {
 			// forward evaluation
+			map<Node<T>*, int> pending;// consumers which have not run yet
 			for (Operation<T>* operation : operations) {
-				vector<Tensor<T>> inputs = operation->getInputs();
-				Tensor<T> value = operation->forward(inputs);
-				operation->setValue(value);
+				pending[operation] = operation->getConsumers().size();
+				operation->reset();
+			}
+			for (Variable<T>* variable : variables) {
+				variable->cast(storage);
+			}
+			Loss<T>* loss = dynamic_cast<Loss<T>*>(operations.back());
+			if (loss != nullptr) {
+				loss->setLossScale(scaler.getScale());
+			}
+			// recomputed segments are short lived, only whole-graph activations are packed
+			bool packing = checkpoints.empty() && storage != precision::FP32;
+			for (Operation<T>* operation : operations) {
+				operation->getInputs(input_views);
+				operation->setValue(operation->forward(input_views));
+				__round_(operation->getValue());
+				if (checkpoints.empty() && !compact && !packing) {
+					continue;
+				}
+				// free the activations between checkpoints as soon as they are consumed,
+				// without checkpoints only those no bprop reads, and in mixed precision
+				// store the others in 16 bits until backward
+				for (Node<T>* input : operation->getInputNodes()) {
+					if (input->getNodeType() != OPERATION || --pending[input] != 0 || __viewed_(input)) {
+						continue;
+					}
+					bool saved = checkpoints.empty() ? __saved_(input) : checkpoints.find(input) != checkpoints.end();
+					if (!saved && (compact || !checkpoints.empty())) {
+						input->release();
+					}
+					else if (packing) {
+						input->pack(storage);
+					}
+				}
+			}
+		}
+		void plan_inference(vector<Node<T>*> &fetches) {
+			// run only the operations the fetches depend on, and free every
+			// other activation right after its last consumer has run
+			set<Node<T>*> kept, needed;
+			for (Node<T>* fetch : fetches) {
+				kept.insert(resolve(fetch));
+				__mark_needed_(resolve(fetch), needed);
+			}
+			inference.clear();
+			for (Operation<T>* operation : operations) {
+				if (needed.find(operation) != needed.end()) {
+					inference.push_back(operation);
+				}
+			}
+			release_plan.assign(inference.size(), vector<Node<T>*>());
+			// freed after operation release_at[i], never when it is inference.size()
+			vector<size_t> release_at(inference.size(), inference.size());
+			for (size_t i = inference.size(); i-- > 0;) {
+				if (kept.find(inference[i]) != kept.end()) {
+					continue;
+				}
+				size_t last = i;
+				for (size_t j = i + 1; j < inference.size(); j++) {
+					vector<Node<T>*> inputs = inference[j]->getInputNodes();
+					if (find(inputs.begin(), inputs.end(), inference[i]) != inputs.end()) {
+						// a view of the input lives as long as the output of j
+						last = max(last, inference[j]->viewsInput() ? release_at[j] : j);
+					}
+				}
+				release_at[i] = last;
+				if (last < inference.size()) {
+					release_plan[last].push_back(inference[i]);
+				}
+			}
+		}
+		void infer() {
+			// forward evaluation without gradient bookkeeping, the released buffers
+			// go to the pool of the session and are reused by the next call
+			for (size_t i = 0; i < inference.size(); i++) {
+				Operation<T>* operation = inference[i];
+				operation->getInputs(input_views);
+				operation->setValue(operation->forward(input_views));
+				for (Node<T>* node : release_plan[i]) {
+					node->release();
+				}
 			}
 		}
 		void build_grad() {
 			// initialize the gradient of loss
+			grad_table.clear();
 			int N = operations.size();
 			Operation<T> *loss = operations[N - 1];
 			Shape shape = loss->getShape();
 			grad_table[loss] = Tensor<T>::eye(shape[4]);
+			if (!checkpoints.empty()) {
+				__build_grad_checkpointed_();
+				return;
+			}
 			// update the gradients of other variables
 			for (Variable<T>* variable : variables) {
 				if (variable->isRequireGrad()) {
@@ -589,6 +1442,64 @@ namespace AutoGrad {
 				}
 			}
 		}
+		void apply_gradients(optimizer::Optimizer<T> &optimizer) {
+			// update all trainable variables in one multi-tensor step
+			vector<optimizer::Parameter<T>> params;
+			for (Variable<T>* variable : variables) {
+				if (!variable->isRequireGrad() || grad_table.find(variable) == grad_table.end()) {
+					continue;
+				}
+				Shape shape = variable->getShape();
+				Tensor<T> &grad = grad_table[variable];
+				if (!(grad.getShape() == shape)) {
+					Tensor<T> reduced = grad.reduce_to(shape);
+					grad = reduced;
+				}
+				if (!(grad.getShape() == shape)) {
+					// a bprop returned the wrong shape, the variable would never train
+					throw runtime_error("apply_gradients: gradient does not match the variable shape");
+				}
+				optimizer::Parameter<T> param = { variable->getData(), grad.getData(), grad.length() };
+				params.push_back(param);
+			}
+			double scale = scaler.getScale();
+			if (storage != precision::FP32 || scale != 1) {
+				// skip the step when a scaled gradient overflowed, then unscale
+				bool finite = true;
+				for (optimizer::Parameter<T> &param : params) {
+					finite = finite && precision::all_finite(param.grad, param.length);
+				}
+				if (!scaler.update(finite)) {
+					printf("apply_gradients: gradient overflow, step skipped, loss scale %g\n", scaler.getScale());
+					return;
+				}
+				T inverse = (T)(1 / scale);
+				for (optimizer::Parameter<T> &param : params) {
+					T *grad = param.grad;
+					parallel::parallel_for(0, param.length, [=](int64_t first, int64_t last) {
+						for (int64_t i = first; i < last; i++) {
+							grad[i] *= inverse;
+						}
+					});
+				}
+			}
+			optimizer.apply(params);
+		}
+		T get_loss() {
+			return operations.back()->getValue().get(0);
+		}
+		double get_loss_scale() { return scaler.getScale(); }
+		vector<Tensor<T>> get_gradients() {
+			// the gradients of the trainable variables in graph order, empty when not computed
+			vector<Tensor<T>> gradients;
+			for (Variable<T>* variable : variables) {
+				if (variable->isRequireGrad()) {
+					auto it = grad_table.find(variable);
+					gradients.push_back(it == grad_table.end() ? Tensor<T>() : it->second);
+				}
+			}
+			return gradients;
+		}
 		// getter
 		vector<Placeholder<T>*> get_placeholders() { return placeholders; }
 		vector<Variable<T>*> get_variables() { return variables; }
@@ -600,16 +1511,131 @@ namespace AutoGrad {
 	class Session {
 	private:
 		Graph<T> graph;
+		bool initialized;
+		vector<Node<T>*> fetches;// fetches of the current inference plan
+		memory::Pool pool;// buffers reused between infer calls
+		int n_fused;// patterns rewritten by fusion
 	public:
-		Session(Node<T> *operation) {
+		Session(Node<T> *operation, bool fusion = true) : initialized(false), n_fused(0) {
 			graph.collect(operation);
+			if (fusion) {
+				n_fused = graph.fuse();// pass fusion=false to debug the unfused graph
+			}
 		}
-		void run(map<Placeholder<T>*, Tensor<T>*> &feed_dict) {
+		int getFused() { return n_fused; }
+		int getUnmaterialized() { return graph.getUnmaterialized(); }
+		void checkpoint(Node<T> *node) {
+			// keep the activation of node, the others are recomputed in backward.
+			// like fetch, throws invalid_argument for a node fusion absorbed
+			graph.set_checkpoint(node);
+		}
+		void checkpoint(int every = 0) {
+			// keep every k-th activation, sqrt(N) segments by default
+			graph.auto_checkpoint(every);
+		}
+		void compact(bool compact) {
+			// true frees the activations backward does not read, they can not be
+			// fetched after run. off by default
+			graph.set_compact(compact);
+		}
+		void mixed_precision(precision::Precision storage, double loss_scale = 0) {
+			// BF16 or FP16 activations and gradients over full precision master
+			// weights, use with Session<float>. FP32 turns it off
+			graph.set_precision(storage, loss_scale);
+		}
+		void initialize() {
 			graph.initialize_all_variables();
+			initialized = true;
+		}
+		void run(map<Placeholder<T>*, Tensor<T>*> &feed_dict) {
+			// variables are initialized once and persist between runs
+			if (!initialized) {
+				initialize();
+			}
+			graph.set_training(true);
 			graph.feed_dict(feed_dict);
 			graph.run(); 
 			graph.build_grad();
 		}
+		T step(map<Placeholder<T>*, Tensor<T>*> &feed_dict, optimizer::Optimizer<T> &optimizer) {
+			// one training step, returns the loss before the update
+			run(feed_dict);
+			graph.apply_gradients(optimizer);
+			return graph.get_loss();
+		}
+		vector<Tensor<T>> gradients() { return graph.get_gradients(); }
+		void train(map<Placeholder<T>*, Tensor<T>*> &dataset, optimizer::Optimizer<T> &optimizer,
+			int n_steps, int batch_size) {
+			// mini-batches along the sample axis of every fed tensor
+			int n_samples = dataset.begin()->second->getShape()[0];
+			map<Placeholder<T>*, Tensor<T>> batches;
+			map<Placeholder<T>*, Tensor<T>*> feed_dict;
+			for (int i = 0; i < n_steps; i++) {
+				int start = (i * batch_size) % n_samples;
+				int end = min(start + batch_size, n_samples);
+				for (auto &item : dataset) {
+					batches[item.first] = item.second->view(start, end);
+					feed_dict[item.first] = &batches[item.first];
+				}
+				T loss = step(feed_dict, optimizer);
+				printf("step:%5d\t loss:%.8f\n", i, (double)loss);
+			}
+		}
+		void train(dataset::Loader<T> &loader, vector<Placeholder<T>*> &placeholders,
+			optimizer::Optimizer<T> &optimizer, int n_steps) {
+			// batches are prepared by the loader threads while the graph runs,
+			// placeholders[i] is fed with the i-th tensor of the dataset
+			map<Placeholder<T>*, Tensor<T>*> feed_dict;
+			clock_t start = clock();
+			for (int i = 0; i < n_steps; i++) {
+				vector<Tensor<T>> &batch = loader.next();
+				for (size_t j = 0; j < placeholders.size() && j < batch.size(); j++) {
+					feed_dict[placeholders[j]] = &batch[j];
+				}
+				T loss = step(feed_dict, optimizer);
+				printf("step:%5d\t loss:%.8f\n", i, (double)loss);
+			}
+			double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+			printf("loader stall: %.3f s over %d steps (%.3f s)\n", loader.getStallTime(), n_steps, seconds);
+		}
+		void infer(map<Placeholder<T>*, Tensor<T>*> &feed_dict, vector<Node<T>*> &fetches) {
+			// inference mode: forward only, only the fetches are kept and the
+			// buffers of the other activations are reused by the next call
+			memory::PoolScope scope(pool);
+			if (!initialized) {
+				graph.initialize_all_variables();
+				initialized = true;
+			}
+			if (fetches != this->fetches) {
+				graph.plan_inference(fetches);
+				this->fetches = fetches;
+			}
+			graph.set_training(false);
+			graph.feed_dict(feed_dict);
+			graph.infer();
+		}
+		void calibrate(map<Placeholder<T>*, Tensor<T>*> &feed_dict) {
+			// records the activation ranges of one representative batch for quantize()
+			if (!initialized) {
+				initialize();
+			}
+			graph.feed_dict(feed_dict);
+			graph.calibrate();
+		}
+		int quantize() {
+			// int8 conv2d/fully_connected for inference, from the calibrated ranges
+			// and the current weights. the session can not be trained afterwards
+			int n_quantized = graph.quantize();
+			fetches.clear();// plan the inference again
+			return n_quantized;
+		}
+		Tensor<T>& fetch(Node<T> *node) {
+			Tensor<T> &value = graph.resolve(node)->getValue();
+			if (value.empty()) {
+				printf("fetch: the activation was released, by compact(), checkpoint() or an inference plan without it\n");
+			}
+			return value;
+		}
 	};
 
 	//----------------------------------------FUNCTIONS-----------------------------
@@ -638,6 +1664,8 @@ namespace AutoGrad {
 			//}
 			if (func == "relu")
 				return new ReLU<T>(x);
+			if (func == "tanh")
+				return new Tanh<T>(x);
 			return new Sigmoid<T>(x);
 		}
 
@@ -664,7 +1692,7 @@ namespace AutoGrad {
 
 		template<class T>
 		Operation<T>* minpooling(Node<T> *x, int width) {
-			return new MaxPooling<T>(x, width);
+			return new MinPooling<T>(x, width);
 		}
 
 		template<class T>
@@ -694,6 +1722,11 @@ namespace AutoGrad {
 			return new Softmax<T>(x);
 		}
 
+		template<class T>
+		Operation<T>* dropout(Node<T> *x, double rate) {
+			return new Dropout<T>(x, rate);
+		}
+
 		template<class T>
 		Operation<T>* mse(Node<T> *x, Node<T> *y) {
 			return new MSE<T>(x, y);
@@ -707,16 +1740,10 @@ namespace AutoGrad {
 	}
 
 	template<class T>
-	void test() {
+	Operation<T>* create_cnn(Placeholder<T> *x) {
 
 		using namespace layers;
 
-		Shape input_shape(NULL, 1, 28, 28, 3);
-		Shape output_shape(NULL, 1, 1, 1, 10);
-
-		Placeholder<T> *x = new Placeholder<T>(input_shape);
-		Placeholder<T> *y = new Placeholder<T>(output_shape);
-
 		Operation<T> *net;
 		// conv1
 		net = conv2d(x, 3, 0, 1, 32);
@@ -731,8 +1758,21 @@ namespace AutoGrad {
 		net = flatten(net);
 		net = fully_connected(net, 10);
 		net = softmax(net);
+		return net;
+	}
+
+	template<class T>
+	void test() {
+
+		using namespace layers;
+
+		Shape input_shape(NULL, 1, 28, 28, 3);
+		Shape output_shape(NULL, 1, 1, 1, 10);
 
-		Operation<T> *loss = cross_entopy(net, y);
+		Placeholder<T> *x = new Placeholder<T>(input_shape);
+		Placeholder<T> *y = new Placeholder<T>(output_shape);
+
+		Operation<T> *loss = cross_entopy(create_cnn(x), y);
 		Session<T> session(loss);
 
 		map<Placeholder<T>*, Tensor<T>*> feed_dict;
@@ -741,4 +1781,275 @@ namespace AutoGrad {
 
 		session.run(feed_dict);
 	}
+
+	template<class T>
+	void benchmark_checkpoint(int n_samples = 16) {
+
+		using namespace layers;
+
+		printf("AutoGrad::benchmark_checkpoint()\n");
+
+		// keep every k-th activation, -1 keeps all, 0 keeps sqrt(N)
+		int densities[] = { -1, 1, 2, 4, 0 };
+		vector<Tensor<T>> expected;// the gradients when every activation is kept
+		for (int every : densities) {
+			rng::set_seed(1);
+			Shape input_shape(n_samples, 1, 28, 28, 3);
+			Shape output_shape(1, 1, 1, n_samples, 10);
+
+			Placeholder<T> *x = new Placeholder<T>(input_shape);
+			Placeholder<T> *y = new Placeholder<T>(output_shape);
+
+			Operation<T> *loss = cross_entopy(create_cnn(x), y);
+			Session<T> session(loss);
+			if (every >= 0) {
+				session.checkpoint(every);
+			}
+
+			Tensor<T> x_data = Tensor<T>::random(input_shape);
+			Tensor<T> y_data = Tensor<T>::random(output_shape);
+			map<Placeholder<T>*, Tensor<T>*> feed_dict;
+			feed_dict[x] = &x_data;
+			feed_dict[y] = &y_data;
+
+			memory::reset_peak();
+			size_t base = memory::stats().current;
+			clock_t start = clock();
+			session.run(feed_dict);
+			double elapsed = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+			// recomputation must give the same gradients as keeping everything
+			vector<Tensor<T>> gradients = session.gradients();
+			if (every < 0) {
+				expected = gradients;
+			}
+			double error = 0;
+			for (size_t i = 0; i < gradients.size() && i < expected.size(); i++) {
+				if (gradients[i].length() != expected[i].length()) {
+					error = INFINITY;
+					break;
+				}
+				for (int64_t j = 0; j < gradients[i].length(); j++) {
+					error = max(error, (double)fabs(gradients[i].getData()[j] - expected[i].getData()[j]));
+				}
+			}
+			printf("checkpoint every %2d: peak memory %8.2f MB, step time %10.2f ms, gradient error %g\n",
+				every, (memory::stats().peak - base) / 1048576.0, elapsed, error);
+		}
+	}
+
+	template<class T>
+	void benchmark_activation_memory(int n_samples = 16) {
+
+		using namespace layers;
+
+		printf("AutoGrad::benchmark_activation_memory()\n");
+
+		// unfused graph, every activation is kept vs only what bprop reads
+		// (relu bits, sigmoid output, pooling argmax, operands of conv/fc)
+		bool modes[] = { false, true };
+		for (bool compact : modes) {
+			Shape input_shape(n_samples, 1, 28, 28, 3);
+			Shape output_shape(1, 1, 1, n_samples, 10);
+
+			Placeholder<T> *x = new Placeholder<T>(input_shape);
+			Placeholder<T> *y = new Placeholder<T>(output_shape);
+
+			Operation<T> *loss = cross_entopy(create_cnn(x), y);
+			Session<T> session(loss, false);
+			session.compact(compact);
+
+			Tensor<T> x_data = Tensor<T>::random(input_shape);
+			Tensor<T> y_data = Tensor<T>::random(output_shape);
+			map<Placeholder<T>*, Tensor<T>*> feed_dict;
+			feed_dict[x] = &x_data;
+			feed_dict[y] = &y_data;
+			session.initialize();// the variables are not counted
+
+			memory::reset_peak();
+			size_t base = memory::stats().current;
+			clock_t start = clock();
+			session.run(feed_dict);
+			double elapsed = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+			printf("%-8s: peak step memory %8.2f MB, step time %10.2f ms\n",
+				compact ? "compact" : "keep all", (memory::stats().peak - base) / 1048576.0, elapsed);
+		}
+	}
+
+	template<class T>
+	void benchmark_fusion(int n_samples = 16, int n_steps = 5) {
+
+		using namespace layers;
+
+		printf("AutoGrad::benchmark_fusion()\n");
+
+		// the same training step with and without fused conv2d/fc + bias + activation
+		bool modes[] = { false, true };
+		for (bool fusion : modes) {
+			Shape input_shape(n_samples, 1, 28, 28, 3);
+			Shape output_shape(1, 1, 1, n_samples, 10);
+
+			Placeholder<T> *x = new Placeholder<T>(input_shape);
+			Placeholder<T> *y = new Placeholder<T>(output_shape);
+
+			Operation<T> *loss = cross_entopy(create_cnn(x), y);
+			Session<T> session(loss, fusion);
+
+			Tensor<T> x_data = Tensor<T>::random(input_shape);
+			Tensor<T> y_data = Tensor<T>::random(output_shape);
+			map<Placeholder<T>*, Tensor<T>*> feed_dict;
+			feed_dict[x] = &x_data;
+			feed_dict[y] = &y_data;
+			session.initialize();// the variables are not counted
+			session.run(feed_dict);// warm-up
+
+			memory::reset_peak();
+			size_t base = memory::stats().current;
+			clock_t start = clock();
+			for (int i = 0; i < n_steps; i++) {
+				session.run(feed_dict);
+			}
+			double elapsed = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / n_steps;
+			printf("%-8s: %d patterns fused, %d forward tensors not materialized, peak step memory %8.2f MB, step time %10.2f ms\n",
+				fusion ? "fused" : "unfused", session.getFused(), session.getUnmaterialized(),
+				(memory::stats().peak - base) / 1048576.0, elapsed);
+		}
+	}
+
+	template<class T>
+	void benchmark_precision(int n_samples = 16, int n_steps = 5) {
+
+		using namespace layers;
+
+		printf("AutoGrad::benchmark_precision() with %d-byte values\n", (int)sizeof(T));
+
+		// the same initial weights and data in each mode
+		precision::Precision modes[] = { precision::FP32, precision::BF16, precision::FP16 };
+		const char *names[] = { "fp32", "bf16", "fp16" };
+		for (int mode = 0; mode < 3; mode++) {
+			rng::set_seed(1);
+			Shape input_shape(n_samples, 1, 28, 28, 3);
+			Shape output_shape(1, 1, 1, n_samples, 10);
+
+			Placeholder<T> *x = new Placeholder<T>(input_shape);
+			Placeholder<T> *y = new Placeholder<T>(output_shape);
+
+			Operation<T> *loss = cross_entopy(create_cnn(x), y);
+			Session<T> session(loss);
+			session.mixed_precision(modes[mode]);
+
+			Tensor<T> x_data = Tensor<T>::random(input_shape);
+			Tensor<T> y_data = Tensor<T>::random(output_shape);
+			map<Placeholder<T>*, Tensor<T>*> feed_dict;
+			feed_dict[x] = &x_data;
+			feed_dict[y] = &y_data;
+
+			optimizer::SGD<T> sgd(0.01);
+			T first = 0, last = 0;
+			session.initialize();// the variables are not counted
+			memory::reset_peak();
+			size_t base = memory::stats().current;
+			clock_t start = clock();
+			for (int i = 0; i < n_steps; i++) {
+				last = session.step(feed_dict, sgd);
+				if (i == 0) {
+					first = last;
+				}
+			}
+			double elapsed = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / n_steps;
+			printf("%s: %10.2f ms per step, peak step memory %8.2f MB, loss %.6f -> %.6f\n",
+				names[mode], elapsed, (memory::stats().peak - base) / 1048576.0, (double)first, (double)last);
+		}
+	}
+
+	template<class T>
+	void benchmark_inference(int n_samples = 16, int n_runs = 10) {
+
+		printf("AutoGrad::benchmark_inference()\n");
+
+		Shape input_shape(n_samples, 1, 28, 28, 3);
+		Placeholder<T> *x = new Placeholder<T>(input_shape);
+		Operation<T> *net = create_cnn(x);
+		Session<T> session(net);
+
+		Tensor<T> x_data = Tensor<T>::random(input_shape);
+		map<Placeholder<T>*, Tensor<T>*> feed_dict;
+		feed_dict[x] = &x_data;
+		vector<Node<T>*> fetches;
+		fetches.push_back(net);
+
+		// warm-up, the fetched output of a call is released by the next one,
+		// so the pool holds every buffer after two calls
+		session.infer(feed_dict, fetches);
+		session.infer(feed_dict, fetches);
+
+		memory::reset_peak();
+		size_t base = memory::stats().current;
+		size_t n_allocs = memory::stats().n_allocs, n_news = memory::news();
+		clock_t start = clock();
+		for (int i = 0; i < n_runs; i++) {
+			session.infer(feed_dict, fetches);
+		}
+		double elapsed = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / n_runs;
+		// tensor buffers missing the pool and operator new calls, e.g. vectors of scratch
+		printf("inference: %10.2f ms per call, %.2f tensor and %.2f other heap allocations per call, peak memory %8.2f MB\n",
+			elapsed, (double)(memory::stats().n_allocs - n_allocs) / n_runs,
+			(double)(memory::news() - n_news) / n_runs, (memory::stats().peak - base) / 1048576.0);
+	}
+
+	template<class T>
+	void benchmark_quantization(int n_samples = 16, int n_runs = 10, int n_batches = 4) {
+
+		printf("AutoGrad::benchmark_quantization()\n");
+
+		// the same weights and inputs for the float and the int8 session
+		Shape input_shape(n_samples, 1, 28, 28, 3);
+		vector<Tensor<T>> batches;
+		for (int i = 0; i < n_batches; i++) {
+			batches.push_back(Tensor<T>::random(input_shape));
+		}
+		vector<Tensor<T>> outputs(2);
+		double elapsed[2];
+		for (int mode = 0; mode < 2; mode++) {
+			rng::set_seed(1);
+			Placeholder<T> *x = new Placeholder<T>(input_shape);
+			Operation<T> *net = create_cnn(x);
+			Session<T> session(net);
+			map<Placeholder<T>*, Tensor<T>*> feed_dict;
+			session.initialize();
+			if (mode == 1) {
+				for (Tensor<T> &batch : batches) {
+					feed_dict[x] = &batch;
+					session.calibrate(feed_dict);
+				}
+				printf("quantize: %d operations in int8\n", session.quantize());
+			}
+			feed_dict[x] = &batches[0];
+			vector<Node<T>*> fetches;
+			fetches.push_back(net);
+			session.infer(feed_dict, fetches);// warm-up
+			clock_t start = clock();
+			for (int i = 0; i < n_runs; i++) {
+				session.infer(feed_dict, fetches);
+			}
+			elapsed[mode] = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / n_runs;
+			outputs[mode] = session.fetch(net);
+		}
+		// accuracy of the int8 outputs against float
+		Tensor<T> &y = outputs[0], &q = outputs[1];
+		int n_classes = y.getShape()[4], n_rows = (int)(y.length() / n_classes), agree = 0;
+		double error = 0;
+		for (int r = 0; r < n_rows; r++) {
+			int best_y = 0, best_q = 0;
+			for (int c = 0; c < n_classes; c++) {
+				int i = r * n_classes + c;
+				error = max(error, fabs((double)y.get(i) - (double)q.get(i)));
+				if (y.get(i) > y.get(r * n_classes + best_y)) best_y = c;
+				if (q.get(i) > q.get(r * n_classes + best_q)) best_q = c;
+			}
+			agree += (best_y == best_q);
+		}
+		printf("float: %10.2f ms per call\nint8:  %10.2f ms per call, speedup %.2fx\n",
+			elapsed[0], elapsed[1], elapsed[0] / elapsed[1]);
+		printf("max |difference| %.6f, top-1 agreement %d/%d\n", error, agree, n_rows);
+	}
 }
@@ -9,6 +9,7 @@
 #include <graphics.h>
 
 #include "tensor.h"
+#include "parallel.h"
 
 namespace image {
 
@@ -16,28 +17,193 @@ namespace image {
 	using namespace tensor;
 	using namespace cv;
 
+	// resize, center crop, normalize and channel order, applied in one pass
+	struct Transform {
+		int rows, cols;// resize to (0 keeps the source size)
+		int crop_rows, crop_cols;// center crop of the resized image (0 keeps all)
+		int channels;// 1 decodes as gray, 3 as color
+		double scale;// applied before the normalization, e.g. 1/255
+		double mean[3], stddev[3];// per channel, after the channel swap
+		bool swap_rb;// BGR -> RGB
+		Transform()
+			: rows(0), cols(0), crop_rows(0), crop_cols(0), channels(3), scale(1.0), swap_rb(false) {
+			for (int i = 0; i < 3; i++) {
+				mean[i] = 0.0;
+				stddev[i] = 1.0;
+			}
+		}
+		bool identity() {
+			return scale == 1.0 && !swap_rb && mean[0] == 0.0 && mean[1] == 0.0 && mean[2] == 0.0
+				&& stddev[0] == 1.0 && stddev[1] == 1.0 && stddev[2] == 1.0;
+		}
+	};
+
+	template<class T> inline int __depth_() { return -1; }
+	template<> inline int __depth_<unsigned char>() { return CV_8U; }
+	template<> inline int __depth_<float>() { return CV_32F; }
+	template<> inline int __depth_<double>() { return CV_64F; }
+
+	inline void __output_size_(const Mat &im, Transform &t, int &rows, int &cols, int &out_rows, int &out_cols) {
+		rows = (t.rows > 0) ? t.rows : im.rows;
+		cols = (t.cols > 0) ? t.cols : im.cols;
+		out_rows = (t.crop_rows > 0) ? min(t.crop_rows, rows) : rows;
+		out_cols = (t.crop_cols > 0) ? min(t.crop_cols, cols) : cols;
+	}
+
+	template<class S, class T>
+	void __transform_(const Mat &im, Transform &t, T *dst) {
+		// bilinear resize of the cropped window, the output is (rows, cols, channels)
+		int rows, cols, out_rows, out_cols;
+		__output_size_(im, t, rows, cols, out_rows, out_cols);
+		int top = (rows - out_rows) / 2, left = (cols - out_cols) / 2;
+		int C = im.channels();
+		double fy = (double)im.rows / rows, fx = (double)im.cols / cols;
+		double a[3], b[3];// value * a + b
+		int src_channel[3];
+		for (int c = 0; c < C; c++) {
+			a[c] = t.scale / t.stddev[c];
+			b[c] = -t.mean[c] / t.stddev[c];
+			src_channel[c] = (t.swap_rb && C == 3) ? 2 - c : c;
+		}
+		vector<int> x0(out_cols), x1(out_cols);
+		vector<double> wx(out_cols);
+		for (int j = 0; j < out_cols; j++) {
+			double x = max(0.0, (j + left + 0.5) * fx - 0.5);
+			x0[j] = min((int)x, im.cols - 1);
+			x1[j] = min(x0[j] + 1, im.cols - 1);
+			wx[j] = x - x0[j];
+		}
+		for (int i = 0; i < out_rows; i++) {
+			double y = max(0.0, (i + top + 0.5) * fy - 0.5);
+			int y0 = min((int)y, im.rows - 1), y1 = min(y0 + 1, im.rows - 1);
+			double wy = y - y0;
+			const S *r0 = im.ptr<S>(y0), *r1 = im.ptr<S>(y1);
+			T *out = dst + (size_t)i * out_cols * C;
+			for (int j = 0; j < out_cols; j++) {
+				for (int c = 0; c < C; c++) {
+					int s = src_channel[c];
+					double top_value = r0[x0[j] * C + s] * (1 - wx[j]) + r0[x1[j] * C + s] * wx[j];
+					double bottom_value = r1[x0[j] * C + s] * (1 - wx[j]) + r1[x1[j] * C + s] * wx[j];
+					double value = top_value * (1 - wy) + bottom_value * wy;
+					out[j * C + c] = (T)(value * a[c] + b[c]);
+				}
+			}
+		}
+	}
+
+	template<class T>
+	bool mat2tensor(const Mat &im, Transform &t, T *dst) {
+		// write one image into dst, rows x cols x channels elements
+		int rows, cols, out_rows, out_cols;
+		__output_size_(im, t, rows, cols, out_rows, out_cols);
+		if (rows == im.rows && cols == im.cols && out_rows == rows && out_cols == cols
+			&& im.depth() == __depth_<T>() && t.identity()) {
+			// the layout already matches, rows are copied as they are
+			size_t row_bytes = (size_t)cols * im.channels() * sizeof(T);
+			for (int i = 0; i < rows; i++) {
+				memcpy((char*)dst + i * row_bytes, im.ptr(i), row_bytes);
+			}
+			return true;
+		}
+		switch (im.depth()) {
+		case CV_8U: __transform_<unsigned char>(im, t, dst); return true;
+		case CV_32F: __transform_<float>(im, t, dst); return true;
+		case CV_64F: __transform_<double>(im, t, dst); return true;
+		default:
+			printf("mat2tensor: unsupported depth %d\n", im.depth());
+			return false;
+		}
+	}
+
 	template<class T>
 	Tensor<T> im2tensor(Mat im) {
-		Tensor<T> tensor(1, im.rows, im.cols, im.channels());
-		tensor.foreach_assign([&](int i, int j, int k, int l) {
-			return (double)(im.at<uchar>(j, k, l));
-		});
+		// one image as a (1, 1, rows, cols, channels) tensor
+		Transform t;
+		Tensor<T> tensor(1, 1, im.rows, im.cols, im.channels());
+		mat2tensor(im, t, tensor.getData());
 		return tensor;
 	}
 
 	template<class T>
-	Mat im2tensor(Tensor<T> tensor) {
+	Tensor<T> im2view(Mat &im) {
+		// no copy when the Mat is continuous and of the same element type,
+		// the view is valid while im is alive. empty otherwise
+		Tensor<T> tensor;
+		if (im.isContinuous() && im.depth() == __depth_<T>()) {
+			Shape shape(1, 1, im.rows, im.cols, im.channels());
+			tensor.bind((T*)im.data, shape);
+		}
+		return tensor;
+	}
+
+	template<class T>
+	Mat tensor2im(Tensor<T> &tensor, int sample = 0) {
+		// sample of a (n, 1, rows, cols, 1 or 3) tensor as an 8-bit image
 		Shape shape = tensor.getShape();
-		Mat mat(shape[1], shape[2], CV_8UC3);// COLOR3
-		Vec3b pixel;
-		Tensor<T> tensor(1, im.rows, im.cols, im.channels);
-		tensor.foreach([&](int i, int j, int k, int l) {
-			uchar value = (uchar)(tensor.at(0, j, k, l));
-			pixel[l] = value;// BGR
-			if (l == shape[3] - 1) {
-				mat.at<Vec3b>(j, k) = pixel;
+		int C = shape[4];
+		Mat mat(shape[2], shape[3], (C == 1) ? CV_8UC1 : CV_8UC3);
+		const T *src = tensor.getData() + shape.sub2ind(sample, 0, 0, 0, 0);
+		for (int i = 0; i < shape[2]; i++) {
+			unsigned char *row = mat.ptr<unsigned char>(i);
+			for (int j = 0; j < shape[3] * C; j++) {
+				row[j] = saturate_cast<unsigned char>(src[(size_t)i * shape[3] * C + j]);
 			}
-		});
+		}
 		return mat;
 	}
-}
\ No newline at end of file
+
+	// decodes a list of image files on worker threads straight into
+	// the sample slots of a batch tensor
+	template<class T>
+	class Pipeline {
+	private:
+		vector<String> files;
+		Transform transform;
+	public:
+		Pipeline(string pattern, Transform transform) : transform(transform) {
+			// e.g. "data/train/*.png"
+			glob(pattern, files, false);
+		}
+		int size() { return (int)files.size(); }
+		Shape getShape(int n_samples) {
+			// every image is resized to the same size, so the first one gives it
+			int rows = transform.crop_rows ? transform.crop_rows : transform.rows;
+			int cols = transform.crop_cols ? transform.crop_cols : transform.cols;
+			if ((rows == 0 || cols == 0) && !files.empty()) {
+				Mat im = imread(files[0], (transform.channels == 1) ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+				int r, c;
+				__output_size_(im, transform, r, c, rows, cols);
+			}
+			return Shape(n_samples, 1, rows, cols, transform.channels);
+		}
+		bool load(int start, int end, Tensor<T> &batch, int slot = 0) {
+			// files [start, end) into samples slot, slot + 1, ... of batch
+			Shape shape = batch.getShape();
+			int sample_length = shape[1] * shape[2] * shape[3] * shape[4];
+			atomic<bool> ok(true);
+			parallel::parallel_for(start, end, [&](int first, int last) {
+				for (int i = first; i < last; i++) {
+					Mat im = imread(files[i], (transform.channels == 1) ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+					int rows, cols, out_rows, out_cols;
+					__output_size_(im, transform, rows, cols, out_rows, out_cols);
+					if (im.empty() || out_rows != shape[2] || out_cols != shape[3]) {
+						printf("Pipeline: can not load %s at the batch size\n", files[i].c_str());
+						ok = false;
+						continue;
+					}
+					T *dst = batch.getData() + (size_t)(slot + i - start) * sample_length;
+					if (!mat2tensor(im, transform, dst)) {
+						ok = false;
+					}
+				}
+			}, 1);
+			return ok;
+		}
+		Tensor<T> load_all() {
+			Shape shape = getShape(size());
+			Tensor<T> batch(shape);
+			load(0, size(), batch);
+			return batch;
+		}
+	};
+}
@@ -245,19 +245,18 @@ namespace layers {
 	class Activation {
 	private:
 		Tensor<T> grad;
+		Tensor<T> output;// sigmoid, the gradient is computed from it in backward
+		vector<uint64_t> positive;// relu, one bit per element
 		string activation;
 	public:
 		Activation(string activation) : activation(activation) { ; }
 		virtual Tensor<T> forward(Tensor<T> &data) {
 			if (activation == "sigmoid") {
-				Tensor<T> value = data.sigmoid();
-				grad = ops::grad_sigmoid(value);
-				return value;
+				output = data.sigmoid();
+				return output;
 			}
 			else if (activation == "relu") {
-				Tensor<T> value = data.relu();
-				grad = ops::grad_relu(data);
-				return value;
+				return ops::relu(data, positive);
 			}
 			else if (activation == "leaky_relu") {
 				value = x.relu(x, max_value, threshold, negative_slope);
@@ -269,6 +268,12 @@ namespace layers {
 
 		}
 		virtual Tensor<T> backward(Tensor<T> &delta) {
+			if (activation == "sigmoid") {
+				return ops::grad_sigmoid(delta, output);
+			}
+			if (activation == "relu") {
+				return ops::grad_relu(delta, positive);
+			}
 			return delta * grad;
 		}
 	};
@@ -291,12 +296,12 @@ namespace layers {
 		}
 		virtual Tensor<T> forward(Tensor<T> data) {
 			x = Layer<T>::forward(data);
-			return x.matmul(weight) + bias;// TODO: matrix+vector
+			return x.matmul(weight, bias, IDENTITY);// the bias is added in the gemm epilogue
 		}
 		virtual Tensor<T> backward(Tensor<T> &delta) {
-			grad_w = x.Transpose().matmul(delta);
+			grad_w = x.matmul(delta, true, false);
 			grad_b = delta.reduce_sum(0);
-			return Layer<T>::backward(delta.matmul(weight.Transpose()));
+			return Layer<T>::backward(delta.matmul(weight, false, true));
 		}
 	};
 
@@ -9,10 +9,27 @@ int main(int argc, char* argv[]) {
 	//tensor::test_basic<double>();
 	//tensor::test_conv<double>();
 	//tensor::test_pooling<double>();
+	//tensor::benchmark_io<double>();
+	//tensor::benchmark_cast<tensor::half>();
+	//tensor::benchmark_cast<tensor::bfloat16>();
+	//tensor::benchmark_large<float>();
+	//tensor::benchmark_indexing<double>();
+	//tensor::benchmark_permute<float>();
+	//tensor::benchmark_gemm<float>();
+	//tensor::benchmark_batch_matmul<float>();
+	//tensor::benchmark_small_gemm<double>();
+	//tensor::benchmark_epilogue<float>();
 
 	//model::test<double>();
 	
-	AutoGrad::test<double>();
+	AutoGrad::test<float>();
+	//AutoGrad::benchmark_fusion<double>();
+	//AutoGrad::benchmark_precision<double>();
+	//AutoGrad::benchmark_precision<float>();
+	//AutoGrad::benchmark_checkpoint<double>();
+	//AutoGrad::benchmark_activation_memory<double>();
+	//AutoGrad::benchmark_inference<double>();
+	//AutoGrad::benchmark_quantization<float>();
 
 	getchar();
 
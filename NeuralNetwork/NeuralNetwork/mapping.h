@@ -0,0 +1,201 @@
+#pragma once
+
+#ifndef _MAPPING_H_
+#define _MAPPING_H_
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "tensor.h"
+
+namespace memory {
+
+	using namespace std;
+	using namespace tensor;
+
+	// access pattern hints of a mapped file
+	enum Access { NORMAL, SEQUENTIAL, RANDOM_ACCESS };
+
+	// read-only mapping of a whole file, pages are loaded on first access
+	// and shared with other processes through the page cache
+	class MappedFile {
+	private:
+		char *base;
+		size_t length;
+#ifdef _WIN32
+		HANDLE file, mapping;
+#endif
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+	public:
+		MappedFile() : base(nullptr), length(0) {
+#ifdef _WIN32
+			file = INVALID_HANDLE_VALUE;
+			mapping = NULL;
+#endif
+		}
+		~MappedFile() {
+			close();
+		}
+		bool open(string path) {
+			close();
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER size;
+			GetFileSizeEx(file, &size);
+			length = (size_t)size.QuadPart;
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping != NULL) {
+				base = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			}
+#else
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0) {
+				length = (size_t)st.st_size;
+				void *addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+				base = (addr == MAP_FAILED) ? nullptr : (char*)addr;
+			}
+			::close(fd);// the mapping keeps the file open
+#endif
+			if (base == nullptr) {
+				close();
+				return false;
+			}
+			return true;
+		}
+		void close() {
+#ifdef _WIN32
+			if (base != nullptr) {
+				UnmapViewOfFile(base);
+			}
+			if (mapping != NULL) {
+				CloseHandle(mapping);
+			}
+			if (file != INVALID_HANDLE_VALUE) {
+				CloseHandle(file);
+			}
+			mapping = NULL;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (base != nullptr) {
+				munmap(base, length);
+			}
+#endif
+			base = nullptr;
+			length = 0;
+		}
+		void advise(Access access) {
+			// hint the kernel how the pages will be read
+#ifndef _WIN32
+			if (base != nullptr) {
+				int advice = (access == SEQUENTIAL) ? MADV_SEQUENTIAL
+					: (access == RANDOM_ACCESS) ? MADV_RANDOM : MADV_NORMAL;
+				madvise(base, length, advice);
+			}
+#endif
+		}
+		void prefetch(size_t offset, size_t n_bytes) {
+			// start reading [offset, offset + n_bytes) ahead of use
+			if (base == nullptr || offset >= length) {
+				return;
+			}
+			n_bytes = min(n_bytes, length - offset);
+#ifdef _WIN32
+#if _WIN32_WINNT >= 0x0602
+			WIN32_MEMORY_RANGE_ENTRY range = { base + offset, n_bytes };
+			PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+#else
+			size_t page = (size_t)sysconf(_SC_PAGESIZE);
+			size_t first = offset / page * page;
+			madvise(base + first, offset + n_bytes - first, MADV_WILLNEED);
+#endif
+		}
+		bool isOpen() { return base != nullptr; }
+		const char* getData() { return base; }
+		size_t size() { return length; }
+	};
+
+	// a binary tensor file (see Tensor::save(path, BINARY)) used in place,
+	// the tensor is a read-only view of the mapping and nothing is copied
+	template<class T>
+	class MappedTensor {
+	private:
+		MappedFile file;
+		Tensor<T> tensor;
+		size_t sample_bytes;
+	public:
+		MappedTensor() : sample_bytes(0) { ; }
+		MappedTensor(string path, Access access = SEQUENTIAL) : sample_bytes(0) {
+			open(path, access);
+		}
+		bool open(string path, Access access = SEQUENTIAL) {
+			tensor.clear();
+			if (!file.open(path)) {
+				cerr << "MappedTensor::open: can not map " << path << endl;
+				return false;
+			}
+			if (file.size() < sizeof(FileHeader)) {
+				cerr << "MappedTensor::open: not a tensor file" << endl;
+				file.close();
+				return false;
+			}
+			FileHeader header;
+			memcpy(&header, file.getData(), sizeof(FileHeader));
+			__swap_header_(header);
+			int size[5];
+			for (int i = 0; i < 5; i++) {
+				size[i] = (int)header.dims[i];
+			}
+			Shape shape(size);
+			if (memcmp(header.magic, FILE_MAGIC, 4) != 0 || header.version > FILE_VERSION
+				|| header.dtype != __dtype_<T>() || (header.little_endian == 1) != __little_endian_()
+				|| header.n_bytes != (unsigned long long)shape.size() * sizeof(T)
+				|| file.size() < sizeof(FileHeader) + header.n_bytes) {
+				// mapped in place only, Dataset::load reads other dtypes or byte orders with Tensor::load
+				cerr << "MappedTensor::open: " << path << " has another dtype or byte order, or is truncated" << endl;
+				file.close();
+				return false;
+			}
+			file.advise(access);
+			tensor.bind((T*)(file.getData() + sizeof(FileHeader)), shape);
+			sample_bytes = (shape[0] > 0) ? (size_t)header.n_bytes / shape[0] : 0;
+			return true;
+		}
+		void close() {
+			tensor.clear();
+			file.close();
+		}
+		bool isOpen() { return file.isOpen(); }
+		Shape getShape() { return tensor.getShape(); }
+		Tensor<T>& getTensor() { return tensor; }
+		void prefetch(int start, int end) {
+			// page in the samples [start, end), e.g. the next batch
+			file.prefetch(sizeof(FileHeader) + start * sample_bytes, (end - start) * sample_bytes);
+		}
+		Tensor<T> slice(int start, int end) {
+			// samples [start, end) as a view, only their pages are read
+			prefetch(start, end);
+			return tensor.view(start, end);
+		}
+	};
+}
+
+#endif // !_MAPPING_H_
@@ -135,13 +135,13 @@ namespace model {
 
 						// 򴫲
 						Tensor<T> D2 = ops::grad_sigmoid(O3) * (O3 - Y0);
-						Tensor<T> D1 = ops::grad_sigmoid(O2) * D2.matmul(weights["w2"].Transpose());
-						Tensor<T> D0 = ops::grad_sigmoid(O1) * D1.matmul(weights["w1"].Transpose());
+						Tensor<T> D1 = ops::grad_sigmoid(O2) * D2.matmul(weights["w2"], false, true);
+						Tensor<T> D0 = ops::grad_sigmoid(O1) * D1.matmul(weights["w1"], false, true);
 
 						//gradients.clear();
-						gradients["w2"] = O2.Transpose().matmul(D2);
-						gradients["w1"] = O1.Transpose().matmul(D1);
-						gradients["w0"] = X0.Transpose().matmul(D0);
+						gradients["w2"] = O2.matmul(D2, true, false);
+						gradients["w1"] = O1.matmul(D1, true, false);
+						gradients["w0"] = X0.matmul(D0, true, false);
 						gradients["b2"] = D2.reduce_sum(0);
 						gradients["b1"] = D1.reduce_sum(0);
 						gradients["b0"] = D0.reduce_sum(0);
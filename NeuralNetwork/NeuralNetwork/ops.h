@@ -14,7 +14,8 @@ namespace ops {
 	
 	template<class T>
 	Tensor<T> dropout(Tensor<T> &x, double rate) {
-		Tensor<T> w = Tensor<T>::mask(x.shape(), 0.1);
+		Shape shape = x.getShape();
+		Tensor<T> w = Tensor<T>::mask(shape, rate);
 		return w * x;
 	}
 
@@ -49,6 +50,81 @@ namespace ops {
 		return grad;
 	}
 
+	// compact saved state: backward reads a bit per element or the output
+	template<class T>
+	Tensor<T> relu(Tensor<T> &x, vector<uint64_t> &positive) {
+		// relu, and bit i of positive is set when x[i] > 0
+		Shape shape = x.getShape();
+		Tensor<T> out(shape);
+		int64_t n = x.length();
+		const T *in = x.getData();
+		T *o = out.getData();
+		positive.resize((n + 63) / 64);
+		parallel::parallel_for(0, (int64_t)positive.size(), [&](int64_t first, int64_t last) {
+			for (int64_t w = first; w < last; w++) {
+				uint64_t bits = 0;
+				int64_t end = min(n, (w + 1) * 64);
+				for (int64_t i = w * 64; i < end; i++) {
+					bool keep = in[i] > 0;
+					bits |= (uint64_t)keep << (i & 63);
+					o[i] = keep ? in[i] : (T)0;
+				}
+				positive[w] = bits;
+			}
+		}, 64);
+		return out;
+	}
+
+	template<class T>
+	Tensor<T> grad_relu(Tensor<T> &D, vector<uint64_t> &positive) {
+		// D where the input was positive, 0 elsewhere
+		Shape shape = D.getShape();
+		Tensor<T> out(shape);
+		int64_t n = D.length();
+		const T *d = D.getData();
+		T *o = out.getData();
+		parallel::parallel_for(0, (int64_t)positive.size(), [&](int64_t first, int64_t last) {
+			for (int64_t w = first; w < last; w++) {
+				uint64_t bits = positive[w];
+				int64_t end = min(n, (w + 1) * 64);
+				for (int64_t i = w * 64; i < end; i++) {
+					o[i] = ((bits >> (i & 63)) & 1) ? d[i] : (T)0;
+				}
+			}
+		}, 64);
+		return out;
+	}
+
+	template<class T>
+	Tensor<T> grad_sigmoid(Tensor<T> &D, Tensor<T> &y) {
+		// D * y * (1 - y) in one pass from the output y
+		Shape shape = D.getShape();
+		Tensor<T> out(shape);
+		const T *d = D.getData(), *p = y.getData();
+		T *o = out.getData();
+		parallel::parallel_for(0, D.length(), [&](int64_t first, int64_t last) {
+			for (int64_t i = first; i < last; i++) {
+				o[i] = d[i] * p[i] * (1 - p[i]);
+			}
+		});
+		return out;
+	}
+
+	template<class T>
+	Tensor<T> grad_tanh(Tensor<T> &D, Tensor<T> &y) {
+		// D * (1 - y^2) from the output y
+		Shape shape = D.getShape();
+		Tensor<T> out(shape);
+		const T *d = D.getData(), *p = y.getData();
+		T *o = out.getData();
+		parallel::parallel_for(0, D.length(), [&](int64_t first, int64_t last) {
+			for (int64_t i = first; i < last; i++) {
+				o[i] = d[i] * (1 - p[i] * p[i]);
+			}
+		});
+		return out;
+	}
+
 	template<class T>
 	Tensor<T> grad_relu(Tensor<T> &x, double max_value, double threshold, double negative_slope) {
 		Tensor<T> grad(x.getShape());
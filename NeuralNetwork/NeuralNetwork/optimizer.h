@@ -1,20 +1,182 @@
 #pragma once
 
-#include "layer.h"
+#include "tensor.h"
+#include "parallel.h"
 
 // Ż
 namespace optimizer {
 
-	using namespace layers;
+	using namespace std;
+	using namespace tensor;
 
+	// a trainable tensor and its gradient, updated in place
+	template<class T>
+	struct Parameter {
+		T *value;
+		T *grad;
+		int64_t length;
+	};
+
+	// multi-tensor optimizer: all parameters are addressed by one flat index,
+	// the optimizer state is kept in contiguous buffers over that index and
+	// the update runs in parallel chunks of it
 	template<class T>
 	class Optimizer {
-	private:
+	protected:
 		double learning_rate;
+		int n_steps;// number of updates applied
+		vector<int64_t> offsets;// flat index of each parameter
+		int64_t total;
+		virtual void reset(int64_t total) { ; }// (re)allocate the optimizer state
+		virtual void prepare() { ; }// constants of the current step
+		virtual void update(T * __restrict w, const T * __restrict g, int64_t offset, int64_t n) {
+			// gradient descent
+			T lr = (T)learning_rate;
+			for (int64_t i = 0; i < n; i++) {
+				w[i] -= lr * g[i];
+			}
+		}
+	public:
+		Optimizer(double lr = 0.001) : learning_rate(lr), n_steps(0), total(0) { ; }
+		virtual ~Optimizer() { ; }
+		double getLearningRate() { return learning_rate; }
+		void setLearningRate(double lr) { learning_rate = lr; }
+		int getSteps() { return n_steps; }
+		void apply(vector<Parameter<T>> &params) {
+			// bind the flat index, the state is reset when the parameters change
+			int64_t n = 0;
+			vector<int64_t> layout;
+			for (Parameter<T> &param : params) {
+				layout.push_back(n);
+				n += param.length;
+			}
+			if (layout != offsets || n != total) {
+				offsets = layout;
+				total = n;
+				n_steps = 0;
+				reset(total);
+			}
+			n_steps++;
+			prepare();
+			// fused update of all parameters
+			parallel::parallel_for(0, total, [&](int64_t first, int64_t last) {
+				int k = (int)(upper_bound(offsets.begin(), offsets.end(), first) - offsets.begin()) - 1;
+				for (; k < (int)params.size() && offsets[k] < last; k++) {
+					int64_t begin = max(first, offsets[k]);
+					int64_t end = min(last, offsets[k] + params[k].length);
+					int64_t i = begin - offsets[k];
+					update(params[k].value + i, params[k].grad + i, begin, end - begin);
+				}
+			}, 4096);
+		}
+	};
+
+	template<class T>
+	class SGD : public Optimizer<T> {
+	public:
+		SGD(double lr = 0.01) : Optimizer<T>(lr) { ; }
+	};
+
+	template<class T>
+	class Momentum : public Optimizer<T> {
+	protected:
+		double momentum;
+		vector<T> velocity;
+		virtual void reset(int64_t total) { velocity.assign(total, 0); }
+		virtual void update(T * __restrict w, const T * __restrict g, int64_t offset, int64_t n) {
+			T lr = (T)this->learning_rate, mu = (T)momentum;
+			T * __restrict v = velocity.data() + offset;
+			for (int64_t i = 0; i < n; i++) {
+				v[i] = mu * v[i] + g[i];
+				w[i] -= lr * v[i];
+			}
+		}
+	public:
+		Momentum(double lr = 0.01, double momentum = 0.9)
+			: Optimizer<T>(lr), momentum(momentum) { ; }
+	};
+
+	template<class T>
+	class Nesterov : public Momentum<T> {
+	protected:
+		virtual void update(T * __restrict w, const T * __restrict g, int64_t offset, int64_t n) {
+			T lr = (T)this->learning_rate, mu = (T)this->momentum;
+			T * __restrict v = this->velocity.data() + offset;
+			for (int64_t i = 0; i < n; i++) {
+				v[i] = mu * v[i] + g[i];
+				w[i] -= lr * (g[i] + mu * v[i]);
+			}
+		}
+	public:
+		Nesterov(double lr = 0.01, double momentum = 0.9)
+			: Momentum<T>(lr, momentum) { ; }
+	};
+
+	template<class T>
+	class RMSProp : public Optimizer<T> {
+	protected:
+		double rho, epsilon;
+		vector<T> square_avg;
+		virtual void reset(int64_t total) { square_avg.assign(total, 0); }
+		virtual void update(T * __restrict w, const T * __restrict g, int64_t offset, int64_t n) {
+			T lr = (T)this->learning_rate, r = (T)rho, eps = (T)epsilon;
+			T * __restrict s = square_avg.data() + offset;
+			for (int64_t i = 0; i < n; i++) {
+				s[i] = r * s[i] + (1 - r) * g[i] * g[i];
+				w[i] -= lr * g[i] / (sqrt(s[i]) + eps);
+			}
+		}
+	public:
+		RMSProp(double lr = 0.001, double rho = 0.9, double epsilon = 1e-8)
+			: Optimizer<T>(lr), rho(rho), epsilon(epsilon) { ; }
+	};
+
+	template<class T>
+	class Adam : public Optimizer<T> {
+	protected:
+		double beta1, beta2, epsilon, weight_decay;
+		double step_size, correction2;// bias corrections of the current step
+		vector<T> moment1, moment2;
+		virtual void reset(int64_t total) {
+			moment1.assign(total, 0);
+			moment2.assign(total, 0);
+		}
+		virtual void prepare() {
+			step_size = this->learning_rate / (1 - ::pow(beta1, this->n_steps));
+			correction2 = 1 / (1 - ::pow(beta2, this->n_steps));
+		}
+		virtual void update(T * __restrict w, const T * __restrict g, int64_t offset, int64_t n) {
+			T b1 = (T)beta1, b2 = (T)beta2, eps = (T)epsilon;
+			T a = (T)step_size, c2 = (T)correction2;
+			T * __restrict m = moment1.data() + offset;
+			T * __restrict v = moment2.data() + offset;
+			for (int64_t i = 0; i < n; i++) {
+				m[i] = b1 * m[i] + (1 - b1) * g[i];
+				v[i] = b2 * v[i] + (1 - b2) * g[i] * g[i];
+				w[i] -= a * m[i] / (sqrt(v[i] * c2) + eps);
+			}
+		}
+	public:
+		Adam(double lr = 0.001, double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8)
+			: Optimizer<T>(lr), beta1(beta1), beta2(beta2), epsilon(epsilon), weight_decay(0) { ; }
+	};
+
+	template<class T>
+	class AdamW : public Adam<T> {
+	protected:
+		virtual void update(T * __restrict w, const T * __restrict g, int64_t offset, int64_t n) {
+			// decoupled weight decay, then the adam step
+			T decay = (T)(1 - this->learning_rate * this->weight_decay);
+			for (int64_t i = 0; i < n; i++) {
+				w[i] *= decay;
+			}
+			Adam<T>::update(w, g, offset, n);
+		}
 	public:
-		Optimizer(double lr = 0.001) :learning_rate(lr) { ; }
-		void optimize(layers::Layer<T> &loss) {
-			
+		AdamW(double lr = 0.001, double weight_decay = 0.01, double beta1 = 0.9,
+			double beta2 = 0.999, double epsilon = 1e-8)
+			: Adam<T>(lr, beta1, beta2, epsilon) {
+			this->weight_decay = weight_decay;
 		}
 	};
-}
\ No newline at end of file
+}
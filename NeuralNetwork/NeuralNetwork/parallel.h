@@ -0,0 +1,156 @@
+#pragma once
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <condition_variable>
+
+namespace parallel {
+
+	using namespace std;
+
+	// persistent worker threads, the calling thread takes part in every job
+	class ThreadPool {
+	private:
+		vector<thread> workers;
+		mutex serial;// held by the caller for a whole job, one job at a time
+		mutex lock;
+		condition_variable wake, done;
+		void (*job)(void*, size_t);// runs one chunk of the current job
+		void *context;
+		size_t n_chunks;
+		atomic<size_t> next;
+		size_t generation;
+		int active;// workers inside the current job
+		bool stopping;
+
+		static bool& __in_job_() {
+			static thread_local bool flag = false;
+			return flag;
+		}
+		template<class Func>
+		static void __invoke_(void *context, size_t chunk) {
+			(*(Func*)context)(chunk);
+		}
+		void __run_chunks_() {
+			size_t chunk;
+			while ((chunk = next++) < n_chunks) {
+				job(context, chunk);
+			}
+		}
+		void __work_() {
+			__in_job_() = true;
+			size_t seen = 0;
+			unique_lock<mutex> guard(lock);
+			while (true) {
+				wake.wait(guard, [&] { return stopping || generation != seen; });
+				if (stopping) {
+					return;
+				}
+				seen = generation;
+				active++;
+				guard.unlock();
+				__run_chunks_();
+				guard.lock();
+				active--;
+				done.notify_all();
+			}
+		}
+	public:
+		ThreadPool(int n_threads)
+			: job(nullptr), context(nullptr), n_chunks(0), next(0),
+			generation(0), active(0), stopping(false) {
+			for (int i = 1; i < n_threads; i++) {
+				workers.push_back(thread(&ThreadPool::__work_, this));
+			}
+		}
+		~ThreadPool() {
+			{
+				lock_guard<mutex> guard(lock);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (thread &worker : workers) {
+				worker.join();
+			}
+		}
+		int size() { return (int)workers.size() + 1; }
+		template<class Func>
+		void run(size_t chunks, Func &func) {
+			// func(chunk) for chunk in [0, chunks), nested jobs run serially
+			if (workers.empty() || chunks <= 1 || __in_job_()) {
+				for (size_t chunk = 0; chunk < chunks; chunk++) {
+					func(chunk);
+				}
+				return;
+			}
+			// other threads calling run wait here until this job is done
+			lock_guard<mutex> exclusive(serial);
+			unique_lock<mutex> guard(lock);
+			done.wait(guard, [&] { return active == 0; });
+			job = &__invoke_<Func>;
+			context = &func;
+			n_chunks = chunks;
+			next = 0;
+			generation++;
+			guard.unlock();
+			wake.notify_all();
+			__in_job_() = true;
+			__run_chunks_();
+			__in_job_() = false;
+			guard.lock();
+			done.wait(guard, [&] { return active == 0; });
+		}
+	};
+
+	inline unique_ptr<ThreadPool>& __pool_() {
+		static unique_ptr<ThreadPool> pool;
+		return pool;
+	}
+
+	inline void set_num_threads(int n_threads) {
+		__pool_().reset(new ThreadPool(max(1, n_threads)));
+	}
+
+	inline ThreadPool& pool() {
+		if (!__pool_()) {
+			set_num_threads((int)thread::hardware_concurrency());
+		}
+		return *__pool_();
+	}
+
+	inline int num_threads() { return pool().size(); }
+
+	// func(first, last) on chunks of [begin, end) of at least grain iterations.
+	// the bounds are 64-bit, func may take int when the range fits in 32 bits
+	template<class Func>
+	void parallel_for(int64_t begin, int64_t end, Func func, int64_t grain = 1024) {
+		int64_t n = end - begin;
+		if (n <= 0) {
+			return;
+		}
+		int64_t n_chunks = min((int64_t)pool().size() * 4, (n + grain - 1) / grain);
+		if (n_chunks <= 1) {
+			func(begin, end);
+			return;
+		}
+		int64_t step = (n + n_chunks - 1) / n_chunks;
+		auto chunk_func = [&](size_t chunk) {
+			int64_t first = begin + (int64_t)chunk * step;
+			int64_t last = min(end, first + step);
+			if (first < last) {
+				func(first, last);
+			}
+		};
+		pool().run((size_t)n_chunks, chunk_func);
+	}
+}
+
+#endif // !_PARALLEL_H_
@@ -0,0 +1,383 @@
+#pragma once
+
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+
+#include "tensor.h"
+#include "parallel.h"
+
+namespace parser {
+
+	using namespace std;
+	using namespace tensor;
+
+	inline bool __space_(char c) {
+		return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+	}
+
+	// powers of ten exactly representable in double
+	const double POW10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	// a scanned number, mantissa * 10^exponent
+	struct Decimal {
+		uint64_t mantissa;
+		int exponent;
+		bool negative;
+		bool exact;// false when nonzero digits beyond the 19th were dropped
+	};
+
+	inline bool __eight_digits_(const char *p, uint64_t &value) {
+		// 8 ascii digits at p at once, false if one of them is not a digit.
+		// the bytes are read as a little-endian word
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		if (((v & 0xF0F0F0F0F0F0F0F0ull) | (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4))
+			!= 0x3333333333333333ull) {
+			return false;
+		}
+		v = (v & 0x0F0F0F0F0F0F0F0Full) * 2561 >> 8;// pairs of digits
+		v = (v & 0x00FF00FF00FF00FFull) * 6553601 >> 16;// groups of 4
+		value = (v & 0x0000FFFF0000FFFFull) * 42949672960001ull >> 32;
+		return true;
+	}
+
+	inline const char* __scan_(const char *first, const char *last, Decimal &d) {
+		// [sign] digits [. digits] [e [sign] digits], returns first when there is no number
+		const char *p = first;
+		d.negative = false;
+		if (p < last && (*p == '-' || *p == '+')) {
+			d.negative = *p++ == '-';
+		}
+		// digits are taken while the mantissa stays below 2^64
+		const uint64_t LIMIT = 1000000000000000000ull, BLOCK_LIMIT = 100000000000ull;
+		static const bool little_endian = __little_endian_();
+		uint64_t m = 0, block = 0;
+		int exponent = 0;
+		bool any = false, truncated = false;
+		for (; p < last && *p >= '0' && *p <= '9'; p++) {
+			any = true;
+			if (m < LIMIT) {
+				m = m * 10 + (*p - '0');
+			}
+			else {
+				exponent++;
+				truncated = truncated || *p != '0';
+			}
+		}
+		if (p < last && *p == '.') {
+			p++;
+			while (little_endian && last - p >= 8 && m < BLOCK_LIMIT && __eight_digits_(p, block)) {
+				any = true;
+				m = m * 100000000 + block;
+				exponent -= 8;
+				p += 8;
+			}
+			for (; p < last && *p >= '0' && *p <= '9'; p++) {
+				any = true;
+				if (m < LIMIT) {
+					m = m * 10 + (*p - '0');
+					exponent--;
+				}
+				else {
+					truncated = truncated || *p != '0';
+				}
+			}
+		}
+		if (!any) {
+			return first;
+		}
+		if (p < last && (*p == 'e' || *p == 'E')) {
+			const char *q = p + 1;
+			bool negative = false;
+			if (q < last && (*q == '-' || *q == '+')) {
+				negative = *q++ == '-';
+			}
+			if (q < last && *q >= '0' && *q <= '9') {
+				int e = 0;
+				for (; q < last && *q >= '0' && *q <= '9'; q++) {
+					e = min(e * 10 + (*q - '0'), 100000);
+				}
+				exponent += negative ? -e : e;
+				p = q;
+			}
+		}
+		d.mantissa = m;
+		d.exponent = exponent;
+		d.exact = !truncated;
+		return p;
+	}
+
+	inline void __two_prod_(double a, double b, double &p, double &e) {
+		// p + e == a * b exactly, fma keeps it exact when the compiler contracts
+		p = a * b;
+		e = fma(a, b, -p);
+	}
+
+	inline double __gap_(double x, bool up) {
+		// distance from a positive normal x to the next double up or down
+		uint64_t bits;
+		memcpy(&bits, &x, sizeof(bits));
+		uint64_t ulp = (bits & 0x7FF0000000000000ull) - (52ull << 52);
+		bool halved = !up && (bits & 0x000FFFFFFFFFFFFFull) == 0;// below a power of two
+		double gap;
+		memcpy(&gap, &ulp, sizeof(gap));
+		return halved ? gap / 2 : gap;
+	}
+
+	inline double __gap_(float x, bool up) {
+		uint32_t bits;
+		memcpy(&bits, &x, sizeof(bits));
+		uint64_t ulp = (uint64_t)(((bits >> 23) & 0xFF) - 127 - 23 + 1023) << 52;// a normal double
+		bool halved = !up && (bits & 0x007FFFFF) == 0;
+		double gap;
+		memcpy(&gap, &ulp, sizeof(gap));
+		return halved ? gap / 2 : gap;
+	}
+
+	inline bool __to_double_(const Decimal &d, double &value) {
+		// correctly rounded, false when the fast paths can not decide
+		if (d.exact && d.mantissa == 0) {
+			value = d.negative ? -0.0 : 0.0;
+			return true;
+		}
+		if (!d.exact || d.exponent < -22 || d.exponent > 22) {
+			return false;
+		}
+		double p = POW10[abs(d.exponent)];
+		if (d.mantissa <= (1ull << 53)) {
+			// exact operands, a single rounding
+			value = (d.exponent < 0) ? (double)d.mantissa / p : (double)d.mantissa * p;
+		}
+		else {
+			// the mantissa as hi + lo exactly, the result as rh + rl to about 2^-90
+			double hi = (double)(d.mantissa >> 11) * 2048.0, lo = (double)(d.mantissa & 2047);
+			double rh, rl;
+			if (d.exponent >= 0) {
+				__two_prod_(hi, p, rh, rl);
+				rl += lo * p;
+			}
+			else {
+				double ph, pl;
+				rh = hi / p;
+				__two_prod_(rh, p, ph, pl);
+				rl = (((hi - ph) - pl) + lo) / p;
+			}
+			value = rh + rl;
+			// undecided when rh + rl is next to the midpoint between two doubles
+			double rest = rl - (value - rh);
+			double gap = __gap_(value, rest > 0);
+			if (gap / 2 - fabs(rest) <= gap * 1e-9) {
+				return false;
+			}
+		}
+		value = d.negative ? -value : value;
+		return true;
+	}
+
+	inline bool __to_float_(const Decimal &d, float &value) {
+		// correctly rounded, false when the fast path can not decide
+		if (d.exact && d.mantissa == 0) {
+			value = d.negative ? -0.0f : 0.0f;
+			return true;
+		}
+		if (!d.exact || d.exponent < -44 || d.exponent > 44) {
+			return false;
+		}
+		// at most three roundings in double, within 2^-50 of the exact value
+		double x = (double)d.mantissa;
+		int e = abs(d.exponent), e1 = min(e, 22);
+		x = (d.exponent < 0) ? x / POW10[e1] : x * POW10[e1];
+		if (e > e1) {
+			x = (d.exponent < 0) ? x / POW10[e - e1] : x * POW10[e - e1];
+		}
+		if (!(x >= FLT_MIN && x < FLT_MAX)) {
+			return false;// subnormal or out of range
+		}
+		float f = (float)x;
+		double rest = x - (double)f;
+		double gap = __gap_(f, rest > 0);
+		if (gap / 2 - fabs(rest) <= x * 1e-14) {
+			return false;
+		}
+		value = d.negative ? -f : f;
+		return true;
+	}
+
+	inline const char* __parse_(const char *first, const char *last, int &value) {
+		// one number, returns the end of it or first on failure
+		char *end = nullptr;
+		value = (int)strtol(first, &end, 10);
+		return (end == nullptr) ? first : end;
+	}
+
+	inline const char* __parse_(const char *first, const char *last, double &value) {
+		// the hand-written scanner, strtod for what it does not decide (inf, nan,
+		// hex, more than 19 digits, large exponents, midpoints)
+		Decimal d;
+		const char *end = __scan_(first, last, d);
+		if (end != first && (end == last || __space_(*end)) && __to_double_(d, value)) {
+			return end;
+		}
+		char *stop = nullptr;
+		value = strtod(first, &stop);
+		return (stop == nullptr) ? first : stop;
+	}
+
+	inline const char* __parse_(const char *first, const char *last, float &value) {
+		// as double, strtof rounds once to float where strtod would round twice
+		Decimal d;
+		const char *end = __scan_(first, last, d);
+		if (end != first && (end == last || __space_(*end)) && __to_float_(d, value)) {
+			return end;
+		}
+		char *stop = nullptr;
+		value = strtof(first, &stop);
+		return (stop == nullptr) ? first : stop;
+	}
+
+	template<class T>
+	inline const char* __parse_(const char *first, const char *last, T &value) {
+		// half and bfloat16 are read as float
+		float f = 0;
+		const char *end = __parse_(first, last, f);
+		value = T(f);
+		return end;
+	}
+
+	inline int __count_(const char *first, const char *last) {
+		int n = 0;
+		while (first < last) {
+			while (first < last && __space_(*first)) first++;
+			if (first == last) break;
+			n++;
+			while (first < last && !__space_(*first)) first++;
+		}
+		return n;
+	}
+
+	template<class T>
+	bool __parse_chunk_(const char *first, const char *last, T *out) {
+		while (first < last) {
+			while (first < last && __space_(*first)) first++;
+			if (first == last) break;
+			const char *end = __parse_(first, last, *out++);
+			if (end == first) {
+				return false;
+			}
+			first = end;
+		}
+		return true;
+	}
+
+	template<class T>
+	bool parse_text(const char *begin, const char *end, Tensor<T> &tensor) {
+		// the layout written by operator<<: 5 dims, then the values
+		int size[5];
+		const char *p = begin;
+		for (int i = 0; i < 5; i++) {
+			while (p < end && __space_(*p)) p++;
+			const char *next = __parse_(p, end, size[i]);
+			if (next == p) {
+				printf("parse_text: bad shape header\n");
+				return false;
+			}
+			p = next;
+		}
+		Shape shape(size);
+		// chunks split on whitespace, counted then parsed in parallel
+		int n_chunks = max(1, parallel::num_threads() * 4);
+		vector<const char*> bounds(n_chunks + 1, end);
+		bounds[0] = p;
+		size_t step = (end - p) / n_chunks + 1;
+		for (int i = 1; i < n_chunks; i++) {
+			const char *q = max(bounds[i - 1], min(end, p + i * step));
+			while (q < end && !__space_(*q)) q++;
+			bounds[i] = q;
+		}
+		vector<int64_t> offsets(n_chunks + 1, 0);
+		parallel::parallel_for(0, n_chunks, [&](int first, int last) {
+			for (int i = first; i < last; i++) {
+				offsets[i + 1] = __count_(bounds[i], bounds[i + 1]);
+			}
+		}, 1);
+		for (int i = 0; i < n_chunks; i++) {
+			offsets[i + 1] += offsets[i];
+		}
+		if (offsets[n_chunks] != shape.size()) {
+			printf("parse_text: %lld values for a shape of %lld\n", (long long)offsets[n_chunks], (long long)shape.size());
+			return false;
+		}
+		Tensor<T> out(shape);
+		T *data = out.getData();
+		vector<char> ok(n_chunks, 1);
+		parallel::parallel_for(0, n_chunks, [&](int first, int last) {
+			for (int i = first; i < last; i++) {
+				ok[i] = __parse_chunk_(bounds[i], bounds[i + 1], data + offsets[i]);
+			}
+		}, 1);
+		if (find(ok.begin(), ok.end(), 0) != ok.end()) {
+			printf("parse_text: bad value\n");
+			return false;
+		}
+		tensor = move(out);
+		return true;
+	}
+
+	inline bool __newer_(string path, string than) {
+		struct stat a, b;
+		return stat(path.c_str(), &a) == 0 && stat(than.c_str(), &b) == 0 && a.st_mtime >= b.st_mtime;
+	}
+
+	template<class T>
+	bool load_text(string path, Tensor<T> &tensor, bool cache = false) {
+		// read the whole file in large blocks and parse it in parallel. with
+		// cache, the tensor is also saved as path.bin and reused while it is newer
+		string cache_path = path + ".bin";
+		if (cache && __newer_(cache_path, path)) {
+			Tensor<T> cached;
+			cached.load(cache_path);
+			if (!cached.empty()) {
+				tensor = move(cached);
+				return true;
+			}
+		}
+		FILE *file = fopen(path.c_str(), "rb");
+		if (file == nullptr) {
+			printf("load_text: can not open %s\n", path.c_str());
+			return false;
+		}
+		struct stat st;
+		size_t length = (stat(path.c_str(), &st) == 0) ? (size_t)st.st_size : 0;
+		vector<char> buffer(length + 1);
+		const size_t BLOCK = 1 << 24;
+		size_t n = 0, got = 0;
+		do {
+			got = fread(buffer.data() + n, 1, min(BLOCK, length - n), file);
+			n += got;
+		} while (got > 0 && n < length);
+		fclose(file);
+		buffer[n] = '\0';// keeps strtod inside the buffer
+		if (!parse_text(buffer.data(), buffer.data() + n, tensor)) {
+			return false;
+		}
+		if (cache) {
+			tensor.save(cache_path, BINARY);
+		}
+		return true;
+	}
+}
+
+#endif // !_PARSER_H_
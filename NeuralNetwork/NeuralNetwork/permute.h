@@ -0,0 +1,247 @@
+#pragma once
+
+#ifndef _PERMUTE_H_
+#define _PERMUTE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PERMUTE_SSE2 1
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "shape.h"
+#include "parallel.h"
+
+namespace permute {
+
+	using namespace std;
+	using shape::Shape;
+
+	// in-register transposes of one square tile: dst row i is src column i.
+	// only the element size matters, the values are moved bit for bit
+	template<size_t Size>
+	struct __tile_ {
+		static const int B = 0;// no SIMD tile, the scalar loop is used
+		static void run(const char *src, int64_t ss, char *dst, int64_t ds) { ; }
+	};
+
+#if defined(__AVX__)
+	template<>
+	struct __tile_<4> {
+		static const int B = 8;
+		static inline void run(const char *src, int64_t ss, char *dst, int64_t ds) {
+			const float *s = (const float*)src;
+			float *d = (float*)dst;
+			__m256 r0 = _mm256_loadu_ps(s), r1 = _mm256_loadu_ps(s + ss);
+			__m256 r2 = _mm256_loadu_ps(s + 2 * ss), r3 = _mm256_loadu_ps(s + 3 * ss);
+			__m256 r4 = _mm256_loadu_ps(s + 4 * ss), r5 = _mm256_loadu_ps(s + 5 * ss);
+			__m256 r6 = _mm256_loadu_ps(s + 6 * ss), r7 = _mm256_loadu_ps(s + 7 * ss);
+			__m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+			__m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+			__m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+			__m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+			__m256 u0 = _mm256_shuffle_ps(t0, t2, 0x44), u1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+			__m256 u2 = _mm256_shuffle_ps(t1, t3, 0x44), u3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+			__m256 u4 = _mm256_shuffle_ps(t4, t6, 0x44), u5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+			__m256 u6 = _mm256_shuffle_ps(t5, t7, 0x44), u7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+			_mm256_storeu_ps(d, _mm256_permute2f128_ps(u0, u4, 0x20));
+			_mm256_storeu_ps(d + ds, _mm256_permute2f128_ps(u1, u5, 0x20));
+			_mm256_storeu_ps(d + 2 * ds, _mm256_permute2f128_ps(u2, u6, 0x20));
+			_mm256_storeu_ps(d + 3 * ds, _mm256_permute2f128_ps(u3, u7, 0x20));
+			_mm256_storeu_ps(d + 4 * ds, _mm256_permute2f128_ps(u0, u4, 0x31));
+			_mm256_storeu_ps(d + 5 * ds, _mm256_permute2f128_ps(u1, u5, 0x31));
+			_mm256_storeu_ps(d + 6 * ds, _mm256_permute2f128_ps(u2, u6, 0x31));
+			_mm256_storeu_ps(d + 7 * ds, _mm256_permute2f128_ps(u3, u7, 0x31));
+		}
+	};
+
+	template<>
+	struct __tile_<8> {
+		static const int B = 4;
+		static inline void run(const char *src, int64_t ss, char *dst, int64_t ds) {
+			const double *s = (const double*)src;
+			double *d = (double*)dst;
+			__m256d r0 = _mm256_loadu_pd(s), r1 = _mm256_loadu_pd(s + ss);
+			__m256d r2 = _mm256_loadu_pd(s + 2 * ss), r3 = _mm256_loadu_pd(s + 3 * ss);
+			__m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+			__m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+			_mm256_storeu_pd(d, _mm256_permute2f128_pd(t0, t2, 0x20));
+			_mm256_storeu_pd(d + ds, _mm256_permute2f128_pd(t1, t3, 0x20));
+			_mm256_storeu_pd(d + 2 * ds, _mm256_permute2f128_pd(t0, t2, 0x31));
+			_mm256_storeu_pd(d + 3 * ds, _mm256_permute2f128_pd(t1, t3, 0x31));
+		}
+	};
+#elif defined(PERMUTE_SSE2)
+	template<>
+	struct __tile_<4> {
+		static const int B = 4;
+		static inline void run(const char *src, int64_t ss, char *dst, int64_t ds) {
+			const float *s = (const float*)src;
+			float *d = (float*)dst;
+			__m128 r0 = _mm_loadu_ps(s), r1 = _mm_loadu_ps(s + ss);
+			__m128 r2 = _mm_loadu_ps(s + 2 * ss), r3 = _mm_loadu_ps(s + 3 * ss);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_storeu_ps(d, r0);
+			_mm_storeu_ps(d + ds, r1);
+			_mm_storeu_ps(d + 2 * ds, r2);
+			_mm_storeu_ps(d + 3 * ds, r3);
+		}
+	};
+#endif
+
+#if defined(PERMUTE_SSE2)
+	template<>
+	struct __tile_<2> {
+		static const int B = 8;
+		static inline void run(const char *src, int64_t ss, char *dst, int64_t ds) {
+			const uint16_t *s = (const uint16_t*)src;
+			uint16_t *d = (uint16_t*)dst;
+			__m128i a0 = _mm_loadu_si128((const __m128i*)s), a1 = _mm_loadu_si128((const __m128i*)(s + ss));
+			__m128i a2 = _mm_loadu_si128((const __m128i*)(s + 2 * ss)), a3 = _mm_loadu_si128((const __m128i*)(s + 3 * ss));
+			__m128i a4 = _mm_loadu_si128((const __m128i*)(s + 4 * ss)), a5 = _mm_loadu_si128((const __m128i*)(s + 5 * ss));
+			__m128i a6 = _mm_loadu_si128((const __m128i*)(s + 6 * ss)), a7 = _mm_loadu_si128((const __m128i*)(s + 7 * ss));
+			__m128i b0 = _mm_unpacklo_epi16(a0, a1), b1 = _mm_unpackhi_epi16(a0, a1);
+			__m128i b2 = _mm_unpacklo_epi16(a2, a3), b3 = _mm_unpackhi_epi16(a2, a3);
+			__m128i b4 = _mm_unpacklo_epi16(a4, a5), b5 = _mm_unpackhi_epi16(a4, a5);
+			__m128i b6 = _mm_unpacklo_epi16(a6, a7), b7 = _mm_unpackhi_epi16(a6, a7);
+			__m128i c0 = _mm_unpacklo_epi32(b0, b2), c1 = _mm_unpackhi_epi32(b0, b2);
+			__m128i c2 = _mm_unpacklo_epi32(b1, b3), c3 = _mm_unpackhi_epi32(b1, b3);
+			__m128i c4 = _mm_unpacklo_epi32(b4, b6), c5 = _mm_unpackhi_epi32(b4, b6);
+			__m128i c6 = _mm_unpacklo_epi32(b5, b7), c7 = _mm_unpackhi_epi32(b5, b7);
+			_mm_storeu_si128((__m128i*)d, _mm_unpacklo_epi64(c0, c4));
+			_mm_storeu_si128((__m128i*)(d + ds), _mm_unpackhi_epi64(c0, c4));
+			_mm_storeu_si128((__m128i*)(d + 2 * ds), _mm_unpacklo_epi64(c1, c5));
+			_mm_storeu_si128((__m128i*)(d + 3 * ds), _mm_unpackhi_epi64(c1, c5));
+			_mm_storeu_si128((__m128i*)(d + 4 * ds), _mm_unpacklo_epi64(c2, c6));
+			_mm_storeu_si128((__m128i*)(d + 5 * ds), _mm_unpackhi_epi64(c2, c6));
+			_mm_storeu_si128((__m128i*)(d + 6 * ds), _mm_unpacklo_epi64(c3, c7));
+			_mm_storeu_si128((__m128i*)(d + 7 * ds), _mm_unpackhi_epi64(c3, c7));
+		}
+	};
+#endif
+
+	const int LEAF = 32;// both sides of a leaf block fit in L1
+
+	template<class T>
+	void __transpose_leaf_(const T *src, int64_t ss, T *dst, int64_t ds, int rows, int cols) {
+		// dst[j * ds + i] = src[i * ss + j], full tiles in registers, the edges element by element
+		const int B = __tile_<sizeof(T)>::B;
+		int i = 0;
+		if (B > 0) {
+			for (; i + B <= rows; i += B) {
+				int j = 0;
+				for (; j + B <= cols; j += B) {
+					__tile_<sizeof(T)>::run((const char*)(src + i * ss + j), ss, (char*)(dst + j * ds + i), ds);
+				}
+				for (; j < cols; j++) {
+					for (int k = i; k < i + B; k++) {
+						dst[j * ds + k] = src[k * ss + j];
+					}
+				}
+			}
+		}
+		for (; i < rows; i++) {
+			for (int j = 0; j < cols; j++) {
+				dst[j * ds + i] = src[i * ss + j];
+			}
+		}
+	}
+
+	template<class T>
+	void __transpose_(const T *src, int64_t ss, T *dst, int64_t ds, int rows, int cols) {
+		// cache-oblivious: halve the longer side until the block is a leaf, so
+		// every level of the cache hierarchy sees blocks that fit it
+		if (rows <= LEAF && cols <= LEAF) {
+			__transpose_leaf_(src, ss, dst, ds, rows, cols);
+			return;
+		}
+		if (rows >= cols) {
+			int half = rows / 2 / 8 * 8;// keep the SIMD tiles aligned to the split
+			half = (half == 0) ? rows / 2 : half;
+			__transpose_(src, ss, dst, ds, half, cols);
+			__transpose_(src + half * ss, ss, dst + half, ds, rows - half, cols);
+		}
+		else {
+			int half = cols / 2 / 8 * 8;
+			half = (half == 0) ? cols / 2 : half;
+			__transpose_(src, ss, dst, ds, rows, half);
+			__transpose_(src + half, ss, dst + half * ds, ds, rows, cols - half);
+		}
+	}
+
+	template<class T>
+	void permute(const T *src, const Shape &shape, const int order[], T *dst) {
+		// dst axis a is src axis order[a], dst is contiguous in the permuted shape
+		int dims[5];
+		int64_t in_strides[5];// src stride of each dst axis
+		for (int a = 0; a < 5; a++) {
+			dims[a] = shape[order[a]];
+			in_strides[a] = shape.stride(order[a]);
+		}
+		int64_t out_strides[5];
+		out_strides[4] = 1;
+		for (int a = 3; a >= 0; a--) {
+			out_strides[a] = out_strides[a + 1] * dims[a + 1];
+		}
+		int64_t n = shape.size();
+		if (n == 0) {
+			return;
+		}
+		// p is the dst axis which is contiguous in src
+		int p = 0;
+		while (order[p] != 4) {
+			p++;
+		}
+		if (p == 4) {
+			// the last axis stays: contiguous rows of dims[4], one copy per row
+			int64_t n_rows = n / dims[4];
+			size_t bytes = dims[4] * sizeof(T);
+			parallel::parallel_for(0, n_rows, [&](int64_t first, int64_t last) {
+				for (int64_t r = first; r < last; r++) {
+					int64_t rest = r, offset = 0;
+					for (int a = 3; a >= 0; a--) {
+						offset += (rest % dims[a]) * in_strides[a];
+						rest /= dims[a];
+					}
+					memcpy(dst + r * dims[4], src + offset, bytes);
+				}
+			}, max<int64_t>(1, 4096 / dims[4]));
+			return;
+		}
+		// a 2-D transpose of (dims[4], dims[p]) for every index of the other
+		// three axes, threaded over those and over panels of PANEL src rows
+		const int PANEL = 64;
+		int outer[3], k = 0;
+		for (int a = 0; a < 4; a++) {
+			if (a != p) {
+				outer[k++] = a;
+			}
+		}
+		int64_t n_outer = (int64_t)dims[outer[0]] * dims[outer[1]] * dims[outer[2]];
+		int n_panels = (dims[4] + PANEL - 1) / PANEL;
+		parallel::parallel_for(0, n_outer * n_panels, [&](int64_t first, int64_t last) {
+			for (int64_t task = first; task < last; task++) {
+				int64_t rest = task / n_panels, in_offset = 0, out_offset = 0;
+				int panel = (int)(task % n_panels);
+				for (int i = 2; i >= 0; i--) {
+					int64_t sub = rest % dims[outer[i]];
+					rest /= dims[outer[i]];
+					in_offset += sub * in_strides[outer[i]];
+					out_offset += sub * out_strides[outer[i]];
+				}
+				int row = panel * PANEL, rows = min(PANEL, dims[4] - row);
+				// src rows run along dst axis 4, src columns along dst axis p
+				__transpose_(src + in_offset + row * in_strides[4], in_strides[4],
+					dst + out_offset + row, out_strides[p], rows, dims[p]);
+			}
+		}, 1);
+	}
+}
+
+#endif // !_PERMUTE_H_
@@ -0,0 +1,294 @@
+#pragma once
+
+#ifndef _PRECISION_H_
+#define _PRECISION_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <algorithm>
+
+#if defined(__F16C__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define PRECISION_F16C 1// msvc has no __F16C__, every AVX2 cpu has F16C
+#endif
+
+#include "parallel.h"
+
+namespace precision {
+
+	// storage precision of activations, gradients and weight copies in
+	// mixed-precision training, the master weights keep the tensor type
+	enum Precision { FP32, BF16, FP16 };
+
+	inline uint32_t __bits_(float x) {
+		uint32_t u;
+		memcpy(&u, &x, 4);
+		return u;
+	}
+
+	inline float __float_(uint32_t u) {
+		float x;
+		memcpy(&x, &u, 4);
+		return x;
+	}
+
+	// bfloat16: the upper half of a float, rounded to nearest even
+	inline uint16_t float_to_bfloat16(float value) {
+		uint32_t x = __bits_(value);
+		if ((x & 0x7FFFFFFF) > 0x7F800000) {
+			return (uint16_t)((x >> 16) | 0x40);// quiet NaN
+		}
+		x += 0x7FFF + ((x >> 16) & 1);
+		return (uint16_t)(x >> 16);
+	}
+
+	inline float bfloat16_to_float(uint16_t h) {
+		return __float_((uint32_t)h << 16);
+	}
+
+	// IEEE half: 5-bit exponent, 10-bit mantissa, rounded to nearest even,
+	// overflow to inf and gradual underflow as the hardware conversion does
+	inline uint16_t float_to_half(float value) {
+		uint32_t x = __bits_(value);
+		uint32_t sign = (x >> 16) & 0x8000;
+		x &= 0x7FFFFFFF;
+		uint32_t h;
+		if (x >= 0x47800000) {
+			// >= 65536 (inf), or NaN
+			h = (x > 0x7F800000) ? 0x7E00 : 0x7C00;
+		}
+		else if (x < 0x38800000) {
+			// subnormal or zero: the float adder rounds the mantissa into place
+			float f = __float_(x) + 0.5f;
+			h = __bits_(f) - __bits_(0.5f);
+		}
+		else {
+			uint32_t odd = (x >> 13) & 1;
+			x += 0xC8000FFF + odd;// rebias the exponent (-112 << 23) and round
+			h = x >> 13;// a carry into the exponent gives inf above 65504
+		}
+		return (uint16_t)(h | sign);
+	}
+
+	inline float half_to_float(uint16_t h) {
+		uint32_t x = (uint32_t)(h & 0x7FFF) << 13;
+		uint32_t exponent = x & 0x0F800000;
+		x += 0x38000000;// 112 << 23
+		if (exponent == 0x0F800000) {
+			x += 0x38000000;// inf or NaN
+		}
+		else if (exponent == 0) {
+			x += 0x00800000;// subnormal, renormalized by the float unit
+			x = __bits_(__float_(x) - __float_(0x38800000));
+		}
+		return __float_(x | ((uint32_t)(h & 0x8000) << 16));
+	}
+
+	// 16-bit element types of Tensor. they only store values, arithmetic
+	// converts to float, so sums and products are computed in float
+	struct half {
+		uint16_t bits;
+		half() = default;
+		half(float value) : bits(float_to_half(value)) { ; }
+		operator float() const { return half_to_float(bits); }
+		half& operator+=(float value) { return *this = half(float(*this) + value); }
+		half& operator-=(float value) { return *this = half(float(*this) - value); }
+		half& operator*=(float value) { return *this = half(float(*this) * value); }
+		half& operator/=(float value) { return *this = half(float(*this) / value); }
+	};
+
+	struct bfloat16 {
+		uint16_t bits;
+		bfloat16() = default;
+		bfloat16(float value) : bits(float_to_bfloat16(value)) { ; }
+		operator float() const { return bfloat16_to_float(bits); }
+		bfloat16& operator+=(float value) { return *this = bfloat16(float(*this) + value); }
+		bfloat16& operator-=(float value) { return *this = bfloat16(float(*this) - value); }
+		bfloat16& operator*=(float value) { return *this = bfloat16(float(*this) * value); }
+		bfloat16& operator/=(float value) { return *this = bfloat16(float(*this) / value); }
+	};
+
+	static_assert(sizeof(half) == 2 && sizeof(bfloat16) == 2, "16-bit types must be 2 bytes");
+
+	// the text format reads and writes them as float
+	inline std::istream& operator>>(std::istream &in, half &value) {
+		float v;
+		in >> v;
+		value = half(v);
+		return in;
+	}
+	inline std::istream& operator>>(std::istream &in, bfloat16 &value) {
+		float v;
+		in >> v;
+		value = bfloat16(v);
+		return in;
+	}
+	inline std::ostream& operator<<(std::ostream &out, half value) { return out << (float)value; }
+	inline std::ostream& operator<<(std::ostream &out, bfloat16 value) { return out << (float)value; }
+
+	// conversion kernels, 8 values per instruction with F16C/AVX2
+	inline void __to_float_(const half *src, float *dst, int n) {
+		int i = 0;
+#ifdef PRECISION_F16C
+		for (; i + 8 <= n; i += 8) {
+			__m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+			_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+		}
+#endif
+		for (; i < n; i++) {
+			dst[i] = half_to_float(src[i].bits);
+		}
+	}
+
+	inline void __from_float_(const float *src, half *dst, int n) {
+		int i = 0;
+#ifdef PRECISION_F16C
+		for (; i + 8 <= n; i += 8) {
+			__m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+			_mm_storeu_si128((__m128i*)(dst + i), h);
+		}
+#endif
+		for (; i < n; i++) {
+			dst[i].bits = float_to_half(src[i]);
+		}
+	}
+
+	inline void __to_float_(const bfloat16 *src, float *dst, int n) {
+		int i = 0;
+#ifdef __AVX2__
+		for (; i + 8 <= n; i += 8) {
+			__m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+			_mm256_storeu_si256((__m256i*)(dst + i), _mm256_slli_epi32(x, 16));
+		}
+#endif
+		for (; i < n; i++) {
+			dst[i] = bfloat16_to_float(src[i].bits);
+		}
+	}
+
+	inline void __from_float_(const float *src, bfloat16 *dst, int n) {
+		int i = 0;
+#ifdef __AVX2__
+		const __m256i bias = _mm256_set1_epi32(0x7FFF), one = _mm256_set1_epi32(1);
+		const __m256i abs_mask = _mm256_set1_epi32(0x7FFFFFFF), inf = _mm256_set1_epi32(0x7F800000);
+		for (; i + 8 <= n; i += 8) {
+			__m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+			// round to nearest even, NaN stays a quiet NaN
+			__m256i lsb = _mm256_and_si256(_mm256_srli_epi32(x, 16), one);
+			__m256i r = _mm256_srli_epi32(_mm256_add_epi32(x, _mm256_add_epi32(bias, lsb)), 16);
+			__m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(x, abs_mask), inf);
+			__m256i quiet = _mm256_or_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(0x40));
+			r = _mm256_blendv_epi8(r, quiet, nan);
+			// 8 x 32 -> 8 x 16, packus works per 128-bit lane
+			r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0xD8);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(r));
+		}
+#endif
+		for (; i < n; i++) {
+			dst[i].bits = float_to_bfloat16(src[i]);
+		}
+	}
+
+	template<class S, class D>
+	void convert(const S *src, D *dst, int64_t n) {
+		// element by element through float
+		parallel::parallel_for(0, n, [=](int64_t first, int64_t last) {
+			for (int64_t i = first; i < last; i++) {
+				dst[i] = (D)(float)src[i];
+			}
+		});
+	}
+
+	template<class D>
+	void __convert_16_(const float *src, D *dst, int64_t n) {
+		// chunks of at most 2^30 values, the kernels index in 32 bits
+		parallel::parallel_for(0, n, [=](int64_t first, int64_t last) {
+			for (; first < last; first += (1 << 30)) {
+				__from_float_(src + first, dst + first, (int)std::min(last - first, (int64_t)1 << 30));
+			}
+		}, 4096);
+	}
+
+	template<class S>
+	void __convert_16_(const S *src, float *dst, int64_t n) {
+		parallel::parallel_for(0, n, [=](int64_t first, int64_t last) {
+			for (; first < last; first += (1 << 30)) {
+				__to_float_(src + first, dst + first, (int)std::min(last - first, (int64_t)1 << 30));
+			}
+		}, 4096);
+	}
+
+	inline void convert(const half *src, float *dst, int64_t n) { __convert_16_(src, dst, n); }
+	inline void convert(const bfloat16 *src, float *dst, int64_t n) { __convert_16_(src, dst, n); }
+	inline void convert(const float *src, half *dst, int64_t n) { __convert_16_(src, dst, n); }
+	inline void convert(const float *src, bfloat16 *dst, int64_t n) { __convert_16_(src, dst, n); }
+
+	inline float round_to(float value, Precision storage) {
+		// the value after a round trip through the storage format
+		switch (storage) {
+		case BF16: return bfloat16_to_float(float_to_bfloat16(value));
+		case FP16: return half_to_float(float_to_half(value));
+		default: return value;
+		}
+	}
+
+	template<class T>
+	void round(T *data, int64_t n, Precision storage) {
+		// emulates storing data in a 16-bit format, in place
+		if (storage == FP32) {
+			return;
+		}
+		parallel::parallel_for(0, n, [=](int64_t first, int64_t last) {
+			for (int64_t i = first; i < last; i++) {
+				data[i] = (T)round_to((float)data[i], storage);
+			}
+		});
+	}
+
+	template<class T>
+	bool all_finite(const T *data, int64_t n) {
+		// false on any inf or NaN, e.g. a gradient which overflowed fp16
+		for (int64_t i = 0; i < n; i++) {
+			if (data[i] - data[i] != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// dynamic loss scaling: the loss gradient is multiplied by the scale so
+	// small gradients survive fp16, a step which overflows is skipped and the
+	// scale halved, after growth_interval good steps the scale is doubled
+	class LossScaler {
+	private:
+		double scale;
+		int growth_interval;// 0 keeps the scale fixed
+		int good_steps;
+	public:
+		LossScaler(double scale = 65536.0, int growth_interval = 2000)
+			: scale(scale), growth_interval(growth_interval), good_steps(0) { ; }
+		double getScale() { return scale; }
+		bool update(bool finite) {
+			// true when the step is applied
+			if (growth_interval == 0) {
+				return finite;
+			}
+			if (!finite) {
+				scale = (scale > 1.0) ? scale / 2 : 1.0;
+				good_steps = 0;
+				return false;
+			}
+			if (++good_steps == growth_interval) {
+				scale *= 2;
+				good_steps = 0;
+			}
+			return true;
+		}
+	};
+}
+
+#endif // !_PRECISION_H_
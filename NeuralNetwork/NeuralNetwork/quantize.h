@@ -0,0 +1,217 @@
+#pragma once
+
+#ifndef _QUANTIZE_H_
+#define _QUANTIZE_H_
+
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "tensor.h"
+#include "parallel.h"
+
+namespace quantize {
+
+	using namespace std;
+	using namespace tensor;
+
+	// activations are unsigned 7-bit: u8 x s8 pairs summed by pmaddubsw stay
+	// below 2 * 127 * 127 and can not saturate the 16-bit intermediate
+	const int ACTIVATION_MAX = 127;
+	const int WEIGHT_MAX = 127;
+
+	// running min/max of each channel (last axis) over the calibration batches
+	struct Range {
+		vector<float> lower, upper;
+		template<class T>
+		void observe(const T *data, int64_t n, int channels) {
+			if ((int)lower.size() != channels) {
+				lower.assign(channels, FLT_MAX);
+				upper.assign(channels, -FLT_MAX);
+			}
+			for (int64_t i = 0; i < n; i++) {
+				int c = (int)(i % channels);
+				float v = (float)data[i];
+				lower[c] = min(lower[c], v);
+				upper[c] = max(upper[c], v);
+			}
+		}
+		float min_value() { return lower.empty() ? 0.0f : *min_element(lower.begin(), lower.end()); }
+		float max_value() { return upper.empty() ? 0.0f : *max_element(upper.begin(), upper.end()); }
+	};
+
+	// real = scale * (q - zero_point)
+	struct QuantParams {
+		float scale;
+		int zero_point;
+	};
+
+	inline QuantParams choose_params(float lower, float upper) {
+		// asymmetric over [lower, upper], widened to contain 0 so zero padding is exact
+		lower = min(lower, 0.0f);
+		upper = max(upper, 0.0f);
+		QuantParams params;
+		params.scale = (upper > lower) ? (upper - lower) / ACTIVATION_MAX : 1.0f;
+		params.zero_point = (int)floor(-lower / params.scale + 0.5f);
+		params.zero_point = min(max(params.zero_point, 0), ACTIVATION_MAX);
+		return params;
+	}
+
+	inline uint8_t __quantize_(float x, float inverse, float zero_point) {
+		float v = x * inverse + zero_point;
+		v = min(max(v, 0.0f), (float)ACTIVATION_MAX);
+		return (uint8_t)(v + 0.5f);
+	}
+
+	inline int __padded_(int k) {
+		return (k + 31) / 32 * 32;
+	}
+
+	// symmetric int8 weights with one scale per output channel, stored as
+	// n rows of k (padded to 32 with zeros) so a dot product reads both
+	// operands contiguously
+	struct QuantizedWeights {
+		int n, k, k_padded;
+		vector<int8_t> data;
+		vector<float> scales;
+		vector<int32_t> sums;// row sums, for the zero point of the input
+		QuantizedWeights() : n(0), k(0), k_padded(0) { ; }
+		template<class T>
+		void quantize(const T *w, int n, int k, int stride_n, int stride_k) {
+			// w[j * stride_n + i * stride_k] is the weight of output j and input i
+			this->n = n;
+			this->k = k;
+			k_padded = __padded_(k);
+			data.assign((size_t)n * k_padded, 0);
+			scales.assign(n, 1.0f);
+			sums.assign(n, 0);
+			parallel::parallel_for(0, n, [&](int first, int last) {
+				for (int j = first; j < last; j++) {
+					float range = 0;
+					for (int i = 0; i < k; i++) {
+						range = max(range, (float)fabs((float)w[(size_t)j * stride_n + (size_t)i * stride_k]));
+					}
+					float scale = (range > 0) ? range / WEIGHT_MAX : 1.0f;
+					int8_t *row = data.data() + (size_t)j * k_padded;
+					for (int i = 0; i < k; i++) {
+						float v = (float)w[(size_t)j * stride_n + (size_t)i * stride_k] / scale;
+						int q = (int)floor(v + 0.5f);
+						row[i] = (int8_t)min(max(q, -WEIGHT_MAX), WEIGHT_MAX);
+						sums[j] += row[i];
+					}
+					scales[j] = scale;
+				}
+			}, 16);
+		}
+	};
+
+	template<class T>
+	void quantize_rows(const T *x, int64_t m, int k, QuantParams params, vector<uint8_t> &out) {
+		// m rows of k values into rows of __padded_(k) bytes, the padding is 0
+		int k_padded = __padded_(k);
+		out.assign((size_t)m * k_padded, 0);
+		float inverse = 1.0f / params.scale, zero_point = (float)params.zero_point;
+		uint8_t *o = out.data();
+		parallel::parallel_for(0, m, [=](int64_t first, int64_t last) {
+			for (int64_t r = first; r < last; r++) {
+				const T *row = x + (size_t)r * k;
+				uint8_t *q = o + (size_t)r * k_padded;
+				for (int i = 0; i < k; i++) {
+					q[i] = __quantize_((float)row[i], inverse, zero_point);
+				}
+			}
+		}, 16);
+	}
+
+	inline int32_t dot(const uint8_t *a, const int8_t *b, int k_padded) {
+		// sum of a[i] * b[i], k_padded is a multiple of 32
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+		__m256i acc = _mm256_setzero_si256();
+		for (int i = 0; i < k_padded; i += 32) {
+			__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+			__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+			acc = _mm256_dpbusd_epi32(acc, va, vb);// vpdpbusd, u8 x s8 into s32
+		}
+#elif defined(__AVX2__)
+		__m256i acc = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+		for (int i = 0; i < k_padded; i += 32) {
+			__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+			__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+			__m256i pairs = _mm256_maddubs_epi16(va, vb);// pmaddubsw, u8 x s8 pairs into s16
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+		}
+#endif
+#if defined(__AVX2__)
+		__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+		return _mm_cvtsi128_si32(sum);
+#else
+		int32_t acc = 0;
+		for (int i = 0; i < k_padded; i++) {
+			acc += (int32_t)a[i] * (int32_t)b[i];
+		}
+		return acc;
+#endif
+	}
+
+	template<class T>
+	void gemm(const vector<uint8_t> &a, int64_t m, QuantParams params, QuantizedWeights &w,
+		const T *bias, ActivationType activation, T *out) {
+		// out(m, n) = activation(dequantize(a * w^T) + bias) with int32 accumulation,
+		// the requantization to T is fused into the write of each value
+		const int BLOCK = 64;// output channels whose weights stay in cache
+		int n = w.n, k_padded = w.k_padded;
+		parallel::parallel_for(0, m, [&](int64_t first, int64_t last) {
+			for (int jb = 0; jb < n; jb += BLOCK) {
+				int je = min(n, jb + BLOCK);
+				for (int64_t r = first; r < last; r++) {
+					const uint8_t *row = a.data() + (size_t)r * k_padded;
+					for (int j = jb; j < je; j++) {
+						int32_t acc = dot(row, w.data.data() + (size_t)j * k_padded, k_padded);
+						acc -= params.zero_point * w.sums[j];
+						float value = (float)acc * (params.scale * w.scales[j]) + (float)bias[j];
+						out[(size_t)r * n + j] = __activation_((T)value, activation);
+					}
+				}
+			}
+		}, 4);
+	}
+
+	template<class T>
+	void quantize_patches(Tensor<T> &x, int width, int stride, QuantParams params, vector<uint8_t> &out) {
+		// im2col of 2d convolution: one row of (width, width, channels) per output
+		// position (sample, frame, column, row), quantized on the way
+		Shape shape = x.getShape();
+		int W = (shape[2] - width) / stride + 1, H = (shape[3] - width) / stride + 1, C = shape[4];
+		int k = width * width * C, k_padded = __padded_(k);
+		int64_t m = (int64_t)shape[0] * shape[1] * W * H;
+		out.assign((size_t)m * k_padded, 0);
+		float inverse = 1.0f / params.scale, zero_point = (float)params.zero_point;
+		const T *src = x.getData();
+		uint8_t *o = out.data();
+		parallel::parallel_for(0, m, [&](int64_t first, int64_t last) {
+			for (int64_t r = first; r < last; r++) {
+				int ol = (int)(r % H), ok = (int)((r / H) % W);
+				int64_t frame = r / ((int64_t)H * W);// frame = sample * frames + j
+				uint8_t *q = o + (size_t)r * k_padded;
+				for (int kk = 0; kk < width; kk++) {
+					// (width * C) contiguous values of row ok * stride + kk
+					const T *line = src + (((size_t)frame * shape[2] + ok * stride + kk) * shape[3] + ol * stride) * C;
+					for (int i = 0; i < width * C; i++) {
+						*q++ = __quantize_((float)line[i], inverse, zero_point);
+					}
+				}
+			}
+		}, 16);
+	}
+}
+
+#endif // !_QUANTIZE_H_
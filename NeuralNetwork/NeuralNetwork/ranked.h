@@ -0,0 +1,116 @@
+#pragma once
+
+#ifndef _RANKED_H_
+#define _RANKED_H_
+
+#include <stdint.h>
+
+#include "shape.h"
+
+namespace ranked {
+
+	using namespace std;
+	using shape::Shape;
+
+	// the offset of (i, j, ...) in a contiguous layout, unrolled at compile time
+	template<int Rank>
+	struct __unroll_ {
+		template<class... Subs>
+		static inline int64_t offset(const int64_t *strides, int i, Subs... subs) {
+			return i * strides[0] + __unroll_<Rank - 1>::offset(strides + 1, subs...);
+		}
+	};
+	template<>
+	struct __unroll_<1> {
+		static inline int64_t offset(const int64_t *strides, int i) {
+			return i;// the last axis is contiguous
+		}
+	};
+
+	// Rank nested loops, func(i, j, ...) in memory order
+	template<int Axis, int Rank>
+	struct __loop_ {
+		template<class Func, class... Subs>
+		static inline void run(const int *dims, Func &func, Subs... subs) {
+			for (int i = 0; i < dims[Axis]; i++) {
+				__loop_<Axis + 1, Rank>::run(dims, func, subs..., i);
+			}
+		}
+	};
+	template<int Rank>
+	struct __loop_<Rank, Rank> {
+		template<class Func, class... Subs>
+		static inline void run(const int *dims, Func &func, Subs... subs) {
+			func(subs...);
+		}
+	};
+
+	// a contiguous rank-2/3/4 view of a buffer, nothing is owned or copied.
+	// a 5-D tensor is viewed by merging its leading axes into the first one
+	template<class T, int Rank>
+	class Ranked {
+		static_assert(Rank >= 1 && Rank <= 5, "rank must be 1 to 5");
+	private:
+		T *data;
+		int dims[Rank];
+		int64_t strides[Rank];
+		void __set_dims_(const int *size) {
+			int64_t stride = 1;
+			for (int i = Rank - 1; i >= 0; i--) {
+				dims[i] = size[i];
+				strides[i] = stride;
+				stride *= size[i];
+			}
+		}
+	public:
+		Ranked(T *data, const int *size) : data(data) {
+			__set_dims_(size);
+		}
+		Ranked(T *data, const Shape &shape) : data(data) {
+			// (s, f, w, h, c) as rank 2 is (s * f * w * h, c)
+			int size[Rank];
+			int first = 5 - Rank;
+			size[0] = shape[0];
+			for (int i = 1; i <= first; i++) {
+				size[0] *= shape[i];
+			}
+			for (int i = 1; i < Rank; i++) {
+				size[i] = shape[first + i];
+			}
+			__set_dims_(size);
+		}
+		template<class... Subs>
+		inline T& operator()(Subs... subs) const {
+			static_assert(sizeof...(Subs) == Rank, "one subscript per axis");
+			return data[__unroll_<Rank>::offset(strides, subs...)];
+		}
+		inline T& operator[](int64_t i) const { return data[i]; }// flat offset
+		inline T* getData() const { return data; }
+		inline T* row(int i) const { return data + i * strides[0]; }
+		inline int dim(int k) const { return dims[k]; }
+		inline int64_t stride(int k) const { return strides[k]; }
+		inline int64_t size() const { return strides[0] * dims[0]; }
+		Shape getShape() const {
+			// the 5-D shape with leading 1s, for Tensor::bind
+			int size[5] = { 1, 1, 1, 1, 1 };
+			for (int i = 0; i < Rank; i++) {
+				size[5 - Rank + i] = dims[i];
+			}
+			return Shape(size);
+		}
+		template<class Func>
+		void foreach(Func func) const {
+			__loop_<0, Rank>::run(dims, func);
+		}
+		template<class Func>
+		void foreach_assign(Func func) const {
+			T *p = data;
+			foreach([&](auto... subs) { *p++ = func(subs...); });
+		}
+	};
+
+	template<class T>
+	using Matrix = Ranked<T, 2>;
+}
+
+#endif // !_RANKED_H_
@@ -0,0 +1,210 @@
+#pragma once
+
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "parallel.h"
+
+namespace rng {
+
+	// Philox4x32-10 (Salmon et al., 2011): a counter-based generator, the
+	// output is a pure function of (key, counter), so any element of any
+	// stream can be drawn independently on any thread
+	inline void philox(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+		const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+		const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+		uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+		uint32_t k0 = key[0], k1 = key[1];
+		for (int round = 0; round < 10; round++) {
+			uint64_t p0 = (uint64_t)M0 * c0;
+			uint64_t p1 = (uint64_t)M1 * c2;
+			uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+			uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+			c1 = (uint32_t)p1;
+			c3 = (uint32_t)p0;
+			c0 = n0;
+			c2 = n2;
+			k0 += W0;
+			k1 += W1;
+		}
+		out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+	}
+
+#if defined(__AVX2__)
+	inline __m256i __mulhilo_(__m256i a, __m256i m, __m256i &hi) {
+		// 8 lanes of 32 x 32 -> 64, vpmuludq only multiplies the even lanes
+		__m256i even = _mm256_mul_epu32(a, m);
+		__m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+		hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+		return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+	}
+
+	// philox on 8 counters at once, lane i of c0 to c3 is the counter of
+	// block i and becomes its output, the same bits as 8 calls of philox
+	inline void philox8(__m256i &c0, __m256i &c1, __m256i &c2, __m256i &c3, const uint32_t key[2]) {
+		const __m256i M0 = _mm256_set1_epi32((int)0xD2511F53), M1 = _mm256_set1_epi32((int)0xCD9E8D57);
+		const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+		uint32_t k0 = key[0], k1 = key[1];
+		for (int round = 0; round < 10; round++) {
+			__m256i hi0, hi1;
+			__m256i lo0 = __mulhilo_(c0, M0, hi0);
+			__m256i lo1 = __mulhilo_(c2, M1, hi1);
+			__m256i n0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32((int)k0));
+			__m256i n2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32((int)k1));
+			c1 = lo1;
+			c3 = lo0;
+			c0 = n0;
+			c2 = n2;
+			k0 += W0;
+			k1 += W1;
+		}
+	}
+#endif
+
+	inline double __to_unit_(uint32_t x) {
+		// [0, 1) with 32 bits
+		return x * (1.0 / 4294967296.0);
+	}
+
+	inline double __to_open_(uint32_t x) {
+		// (0, 1), safe for log
+		return (x + 0.5) * (1.0 / 4294967296.0);
+	}
+
+	// sequential draws of the stream (seed, stream), e.g. one stream per sample
+	class Generator {
+	private:
+		uint32_t key[2];
+		uint32_t counter[4];
+		uint32_t block[4];
+		int used;
+	public:
+		Generator(uint64_t seed, uint64_t stream = 0) : used(4) {
+			key[0] = (uint32_t)seed;
+			key[1] = (uint32_t)(seed >> 32);
+			counter[0] = 0;
+			counter[1] = 0;
+			counter[2] = (uint32_t)stream;
+			counter[3] = (uint32_t)(stream >> 32);
+		}
+		uint32_t next() {
+			if (used == 4) {
+				philox(counter, key, block);
+				if (++counter[0] == 0) {
+					counter[1]++;
+				}
+				used = 0;
+			}
+			return block[used++];
+		}
+		double uniform() { return __to_unit_(next()); }
+		double uniform(double low, double high) { return low + (high - low) * uniform(); }
+		int randint(int n) { return (int)(uniform() * n); }// [0, n)
+		double normal() {
+			double r = sqrt(-2.0 * log(__to_open_(next())));
+			return r * cos(6.283185307179586 * __to_unit_(next()));
+		}
+	};
+
+	// the global seed, every random tensor takes the next stream of it, so a
+	// program draws the same numbers in every run and with any number of threads
+	inline uint64_t& __seed_() {
+		static uint64_t seed = 5489;
+		return seed;
+	}
+	inline std::atomic<uint64_t>& __streams_() {
+		static std::atomic<uint64_t> streams(0);
+		return streams;
+	}
+	inline void set_seed(uint64_t seed) {
+		__seed_() = seed;
+		__streams_() = 0;
+	}
+	inline uint64_t get_seed() { return __seed_(); }
+	inline uint64_t next_stream() { return __streams_()++; }
+
+	template<class T, class Func>
+	void __fill_blocks_(T *data, int64_t n, uint64_t seed, uint64_t stream, Func func) {
+		// element i comes from block i / 4 of the stream, the blocks are
+		// independent so the chunks of the thread pool can run in any order
+		uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+		int64_t n_blocks = (n + 3) / 4;
+		parallel::parallel_for(0, n_blocks, [&](int64_t first, int64_t last) {
+			uint32_t counter[4] = { 0, 0, (uint32_t)stream, (uint32_t)(stream >> 32) };
+			uint32_t block[4];
+			T values[4];
+			auto put = [&](int64_t b) {
+				func(block, values);
+				int m = (b * 4 + 4 <= n) ? 4 : (int)(n - b * 4);
+				for (int k = 0; k < m; k++) {
+					data[b * 4 + k] = values[k];
+				}
+			};
+			int64_t b = first;
+#if defined(__AVX2__)
+			// 8 blocks per philox8, the rest one by one
+			alignas(32) uint32_t lanes[4][8];
+			for (; b + 8 <= last; b += 8) {
+				for (int i = 0; i < 8; i++) {
+					lanes[0][i] = (uint32_t)(b + i);
+					lanes[1][i] = (uint32_t)((b + i) >> 32);
+				}
+				__m256i c0 = _mm256_load_si256((const __m256i*)lanes[0]);
+				__m256i c1 = _mm256_load_si256((const __m256i*)lanes[1]);
+				__m256i c2 = _mm256_set1_epi32((int)counter[2]);
+				__m256i c3 = _mm256_set1_epi32((int)counter[3]);
+				philox8(c0, c1, c2, c3, key);
+				_mm256_store_si256((__m256i*)lanes[0], c0);
+				_mm256_store_si256((__m256i*)lanes[1], c1);
+				_mm256_store_si256((__m256i*)lanes[2], c2);
+				_mm256_store_si256((__m256i*)lanes[3], c3);
+				for (int i = 0; i < 8; i++) {
+					for (int k = 0; k < 4; k++) {
+						block[k] = lanes[k][i];
+					}
+					put(b + i);
+				}
+			}
+#endif
+			for (; b < last; b++) {
+				counter[0] = (uint32_t)b;
+				counter[1] = (uint32_t)(b >> 32);
+				philox(counter, key, block);
+				put(b);
+			}
+		}, 1024);
+	}
+
+	template<class T>
+	void fill_uniform(T *data, int64_t n, double low, double high, uint64_t seed, uint64_t stream) {
+		double scale = high - low;
+		__fill_blocks_(data, n, seed, stream, [=](const uint32_t *block, T *values) {
+			for (int k = 0; k < 4; k++) {
+				values[k] = (T)(low + scale * __to_unit_(block[k]));
+			}
+		});
+	}
+
+	template<class T>
+	void fill_normal(T *data, int64_t n, double mean, double stddev, uint64_t seed, uint64_t stream) {
+		// Box-Muller, each block gives two pairs of normals
+		__fill_blocks_(data, n, seed, stream, [=](const uint32_t *block, T *values) {
+			for (int k = 0; k < 4; k += 2) {
+				double r = stddev * sqrt(-2.0 * log(__to_open_(block[k])));
+				double theta = 6.283185307179586 * __to_unit_(block[k + 1]);
+				values[k] = (T)(mean + r * cos(theta));
+				values[k + 1] = (T)(mean + r * sin(theta));
+			}
+		});
+	}
+}
+
+#endif // !_RNG_H_
@@ -1,10 +1,16 @@
 #include "tensor.h"
+#include "parser.h"
+
+#include <chrono>
 
 using namespace std;
 using namespace shape;
 using namespace tensor;
 
 template class Tensor<double>;
+template class Tensor<float>;
+template class Tensor<half>;
+template class Tensor<bfloat16>;
 
 typedef Tensor<double> DoubleTensor;
 typedef Tensor<float> FloatTensor;
@@ -13,10 +19,43 @@ typedef Tensor<int> IntTensor;
 template void tensor::test_basic<double>();
 template void tensor::test_conv<double>();
 template void tensor::test_pooling<double>();
+template void tensor::benchmark_io<double>(int);
+template void tensor::test_basic<float>();
+template void tensor::test_conv<float>();
+template void tensor::test_pooling<float>();
+template void tensor::benchmark_io<float>(int);
+template void tensor::benchmark_cast<half>(int);
+template void tensor::benchmark_cast<bfloat16>(int);
+template void tensor::benchmark_large<float>(int, int);
+template void tensor::benchmark_indexing<double>(int, int);
+template void tensor::benchmark_permute<double>(int, int);
+template void tensor::benchmark_permute<float>(int, int);
+template void tensor::benchmark_gemm<double>(int, int);
+template void tensor::benchmark_gemm<float>(int, int);
+template void tensor::benchmark_batch_matmul<double>(int, int);
+template void tensor::benchmark_batch_matmul<float>(int, int);
+template void tensor::benchmark_small_gemm<double>(int, int);
+template void tensor::benchmark_small_gemm<float>(int, int);
+template void tensor::benchmark_epilogue<double>(int, int);
+template void tensor::benchmark_epilogue<float>(int, int);
 
 int after[] = { 0, 1, 3, 4, 2 };
 int before[] = { 0, 1, 4, 2, 3 };
 
+// every heap allocation outside the tensor buffers, for the allocation counts of the benchmarks
+void* operator new(size_t bytes) {
+	memory::news()++;
+	void *p = malloc(bytes == 0 ? 1 : bytes);
+	if (p == nullptr) {
+		throw bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
 template<class T>
 void tensor::test_basic() {
 
@@ -109,4 +148,410 @@ void tensor::test_pooling() {
 	tensor.min_pooling(2).upsampling(tensor, 2).permute(before).print();
 	tensor.avg_pooling(2).avg_upsampling(2).permute(before).print();
 
-}
\ No newline at end of file
+}
+
+template<class T>
+void tensor::benchmark_io(int n_samples) {
+
+	printf("tensor::benchmark_io()\n");
+
+	// a mnist-like dataset, saved as text and as binary
+	Shape shape(n_samples, 1, 28, 28, 1);
+	Tensor<T> tensor = Tensor<T>::random(shape);
+	tensor.save("benchmark_io.txt", TEXT);
+	tensor.save("benchmark_io.bin", BINARY);
+	double mb = tensor.size() / (1024.0 * 1024.0);
+
+	const char *paths[] = { "benchmark_io.txt", "benchmark_io.bin", "benchmark_io.txt" };
+	const char *names[] = { "text", "binary", "parser" };
+	Tensor<T> loaded[3];
+	for (int i = 0; i < 3; i++) {
+		Shape loaded_shape;
+		auto start = chrono::steady_clock::now();
+		if (i == 2) {
+			parser::load_text(paths[i], loaded[i]);
+		}
+		else {
+			loaded[i].load(paths[i]);
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		loaded_shape = loaded[i].getShape();
+		bool same = (loaded_shape == shape);
+		if (same && i == 2) {
+			// the parser must read the same bits as operator>>
+			same = loaded[0].size() == loaded[i].size()
+				&& memcmp(loaded[i].getData(), loaded[0].getData(), loaded[i].size()) == 0;
+		}
+		printf("%-8s %8.2f MB in %8.3f s, %10.2f MB/s, %s\n", names[i], mb, seconds,
+			mb / max(seconds, 1e-6), same ? "ok" : "mismatch");
+	}
+	remove("benchmark_io.txt");
+	remove("benchmark_io.bin");
+}
+template<class T>
+void tensor::benchmark_cast(int n) {
+
+	printf("tensor::benchmark_cast()\n");
+
+	// float -> 16-bit -> float, the 16-bit tensor takes half the memory
+	Shape shape(1, 1, 1, 1, n);
+	Tensor<float> values = Tensor<float>::normal(shape, 0, 1);
+	auto start = chrono::steady_clock::now();
+	Tensor<T> packed = values.cast<T>();
+	double to = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	start = chrono::steady_clock::now();
+	Tensor<float> unpacked = packed.template cast<float>();
+	double from = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	double error = 0;
+	for (int i = 0; i < n; i++) {
+		float v = values.get(i);
+		if (fabs(v) > 1e-3) {// fp16 is subnormal below 6e-5
+			error = max(error, (double)fabs((unpacked.get(i) - v) / v));
+		}
+	}
+	double gb = values.size() / 1e9;
+	printf("%d values, %.2f MB -> %.2f MB: to %8.2f GB/s, back %8.2f GB/s, max relative error %g\n",
+		n, values.size() / 1048576.0, packed.size() / 1048576.0,
+		gb / max(to, 1e-9), gb / max(from, 1e-9), error);
+}
+template<class T>
+void tensor::benchmark_large(int n_samples, int n_channels) {
+
+	printf("tensor::benchmark_large()\n");
+
+	// more than 2^31 elements by default (8.6 GB of float), every offset
+	// past INT_MAX used to wrap around
+	Shape shape(n_samples, 1, 1, 1, n_channels);
+	int64_t n = shape.size();
+	double gb = n * sizeof(T) / 1e9;
+	printf("%lld elements, %.2f GB, 32-bit offsets: %s\n", (long long)n, gb, shape.fits_int() ? "yes" : "no");
+
+	auto start = chrono::steady_clock::now();
+	Tensor<T> x = Tensor<T>::mask(shape, 0.5);// random fill and a parallel pass
+	double fill = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	start = chrono::steady_clock::now();
+	double mean = (double)x.reduce_mean().get(0) / n;// a serial pass through foreach_elem, it sums
+	double reduce = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	printf("mask:   %8.2f GB/s\nreduce: %8.2f GB/s, mean %.4f (expected 0.5)\n",
+		gb / max(fill, 1e-9), gb / max(reduce, 1e-9), mean);
+
+	// the last element through each way of indexing
+	int64_t last = n - 1;
+	T value = x.get(last);
+	bool match = x.at(n_samples - 1, 0, 0, 0, n_channels - 1) == value;
+	Tensor<T> tail = x.view(n_samples - 1, n_samples);
+	match = match && tail.get(n_channels - 1) == value;
+	x.set((T)2, last);
+	match = match && tail.get(n_channels - 1) == (T)2;
+	printf("last element by offset, subscripts and view: %s\n", match ? "ok" : "MISMATCH");
+}
+template<class T>
+void tensor::benchmark_indexing(int n_samples, int n_runs) {
+
+	printf("tensor::benchmark_indexing()\n");
+
+	// the sum of every element, visited by subscripts in four ways
+	Shape shape(n_samples, 4, 32, 32, 16);
+	Tensor<T> x = Tensor<T>::random(shape);
+	const T *data = x.getData();
+	const char *names[] = { "multiply chain", "cached strides", "iterator", "flat offset" };
+	double sums[4];
+	for (int way = 0; way < 4; way++) {
+		auto start = chrono::steady_clock::now();
+		double sum = 0;
+		for (int run = 0; run < n_runs; run++) {
+			if (way == 0) {
+				// the former sub2ind, five dependent multiplies per element
+				x.foreach([&](int i, int j, int k, int l, int m) {
+					sum += data[((((i * shape[1] + j) * shape[2] + k) * shape[3] + l) * shape[4] + m)];
+				});
+			}
+			else if (way == 1) {
+				x.foreach([&](int i, int j, int k, int l, int m) {
+					sum += x.at(i, j, k, l, m);
+				});
+			}
+			else if (way == 2) {
+				for (IndexIterator it(shape); it.valid(); it.next()) {
+					sum += data[it.getOffset()];
+				}
+			}
+			else {
+				for (int64_t i = 0; i < x.length(); i++) {
+					sum += data[i];
+				}
+			}
+		}
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		sums[way] = sum;
+		printf("%-16s %8.2f ns per element\n", names[way], 1e9 * elapsed / ((double)x.length() * n_runs));
+	}
+	bool match = sums[0] == sums[1] && sums[1] == sums[2] && sums[2] == sums[3];
+	printf("sums %s\n", match ? "match" : "DIFFER");
+}
+template<class T>
+void tensor::benchmark_permute(int n_samples, int n_runs) {
+
+	printf("tensor::benchmark_permute() with %d-byte values\n", (int)sizeof(T));
+
+	// bandwidth as a fraction of a memcpy of the same tensor, a permute reads
+	// and writes every element once as memcpy does
+	Shape shape(n_samples, 1, 28, 28, 64);
+	Tensor<T> x = Tensor<T>::random(shape);
+	Tensor<T> copy(shape);
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < n_runs; i++) {
+		memcpy(copy.getData(), x.getData(), x.size());
+	}
+	double base = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_runs;
+	double gb = 2.0 * x.size() / 1e9;
+	printf("memcpy:    %8.2f ms, %8.2f GB/s\n", 1e3 * base, gb / base);
+
+	int transpose[] = { 0, 1, 2, 4, 3 };
+	int *orders[] = { before, after, transpose };
+	const char *names[] = { "before", "after", "transpose" };
+	for (int o = 0; o < 3; o++) {
+		int *order = orders[o];
+		Tensor<T> y = x.permute(order);// warm-up
+		start = chrono::steady_clock::now();
+		for (int i = 0; i < n_runs; i++) {
+			y = x.permute(order);
+		}
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_runs;
+		// the former kernel: one strided read per element in output order
+		Shape shape_out = y.getShape();
+		Tensor<T> gathered(shape_out);
+		start = chrono::steady_clock::now();
+		gathered.foreach_assign([&](int i, int j, int k, int l, int m) {
+			int subs[5];
+			subs[order[0]] = i; subs[order[1]] = j; subs[order[2]] = k; subs[order[3]] = l; subs[order[4]] = m;
+			return x.at(subs[0], subs[1], subs[2], subs[3], subs[4]);
+		});
+		double gather = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		bool match = memcmp(y.getData(), gathered.getData(), y.size()) == 0;
+		printf("%-10s %8.2f ms, %8.2f GB/s, %.2f of memcpy (gather %.2f ms), %s\n", names[o],
+			1e3 * elapsed, gb / elapsed, base / elapsed, 1e3 * gather, match ? "ok" : "MISMATCH");
+	}
+}
+
+template<class T>
+void tensor::benchmark_gemm(int n_samples, int n_runs) {
+	printf("tensor::benchmark_gemm() with %d-byte values\n", (int)sizeof(T));
+
+	// the two products of the backward pass of a fully connected layer
+	// y = x * w, with a transposed copy first and with the transposed variants
+	int n_input = 1024, n_output = 512;
+	Shape shape_x(1, 1, 1, n_samples, n_input), shape_w(1, 1, 1, n_input, n_output);
+	Shape shape_delta(1, 1, 1, n_samples, n_output);
+	Tensor<T> x = Tensor<T>::random(shape_x);
+	Tensor<T> w = Tensor<T>::random(shape_w);
+	Tensor<T> delta = Tensor<T>::random(shape_delta);
+	double gflop = 2.0 * n_samples * n_input * n_output / 1e9;
+	const char *names[] = { "delta * w^T", "x^T * delta" };
+	for (int p = 0; p < 2; p++) {
+		Tensor<T> copied, packed;
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < n_runs; i++) {
+			if (p == 0) {
+				Tensor<T> w_t = w.Transpose();
+				copied = delta.matmul(w_t);
+			}
+			else {
+				Tensor<T> x_t = x.Transpose();
+				copied = x_t.matmul(delta);
+			}
+		}
+		double before = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_runs;
+		start = chrono::steady_clock::now();
+		for (int i = 0; i < n_runs; i++) {
+			packed = (p == 0) ? delta.matmul(w, false, true) : x.matmul(delta, true, false);
+		}
+		double after = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_runs;
+		double error = 0;
+		for (int64_t i = 0; i < packed.length(); i++) {
+			error = max(error, fabs((double)packed.get(i) - (double)copied.get(i)));
+		}
+		printf("%s: transposed copy %8.2f ms (%6.2f GFLOP/s), packed %8.2f ms (%6.2f GFLOP/s), max error %g\n",
+			names[p], 1e3 * before, gflop / before, 1e3 * after, gflop / after, error);
+	}
+
+	// accumulate into the output: c = 0.5 * x^T * delta + 2 * c
+	Tensor<T> c = Tensor<T>::random(shape_w);
+	Tensor<T> x_t = x.Transpose();
+	Tensor<T> product = x_t.matmul(delta) * (T)0.5, scaled = c * (T)2;
+	Tensor<T> expected = product + scaled;
+	x.matmul(delta, true, false, (T)0.5, (T)2, c);
+	double error = 0;
+	for (int64_t i = 0; i < c.length(); i++) {
+		error = max(error, fabs((double)c.get(i) - (double)expected.get(i)));
+	}
+	printf("alpha/beta: max error %g\n", error);
+}
+
+template<class T>
+void tensor::benchmark_batch_matmul(int n_samples, int n_runs) {
+	printf("tensor::benchmark_batch_matmul() with %d-byte values\n", (int)sizeof(T));
+
+	// q * k^T of 8 heads per sample (small matrices, parallel over the batch),
+	// a shared matrix times a batch of states (broadcast) and a few large
+	// products (parallel inside each), against one product per entry
+	Shape shapes_a[] = { Shape(n_samples, 1, 8, 64, 64), Shape(1, 1, 1, 64, 64), Shape(2, 1, 1, 512, 512) };
+	Shape shapes_b[] = { Shape(n_samples, 1, 8, 64, 64), Shape(n_samples, 1, 4, 64, 16), Shape(2, 1, 1, 512, 512) };
+	bool trans_b[] = { true, false, false };
+	const char *names[] = { "attention", "broadcast", "large" };
+	for (int p = 0; p < 3; p++) {
+		Tensor<T> a = Tensor<T>::random(shapes_a[p]);
+		Tensor<T> b = Tensor<T>::random(shapes_b[p]);
+		Tensor<T> out = a.batch_matmul(b, false, trans_b[p]);// warm-up
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < n_runs; i++) {
+			out = a.batch_matmul(b, false, trans_b[p]);
+		}
+		double batched = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_runs;
+		// the same entries one matmul at a time on views of the operands
+		Shape shape_out = out.getShape();
+		Shape entry_a(1, 1, 1, shapes_a[p][3], shapes_a[p][4]), entry_b(1, 1, 1, shapes_b[p][3], shapes_b[p][4]);
+		Tensor<T> expected(shape_out);
+		int64_t size_out = (int64_t)shape_out[3] * shape_out[4];
+		start = chrono::steady_clock::now();
+		for (int i = 0; i < shape_out[0]; i++) {
+			for (int j = 0; j < shape_out[1]; j++) {
+				for (int k = 0; k < shape_out[2]; k++) {
+					Tensor<T> x, y;
+					x.bind(a.getData() + shapes_a[p](i % shapes_a[p][0], j % shapes_a[p][1], k % shapes_a[p][2], 0, 0), entry_a);
+					y.bind(b.getData() + shapes_b[p](i % shapes_b[p][0], j % shapes_b[p][1], k % shapes_b[p][2], 0, 0), entry_b);
+					Tensor<T> z = x.matmul(y, false, trans_b[p]);
+					memcpy(expected.getData() + shape_out(i, j, k, 0, 0), z.getData(), size_out * sizeof(T));
+				}
+			}
+		}
+		double single = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		double error = 0;
+		for (int64_t i = 0; i < out.length(); i++) {
+			error = max(error, fabs((double)out.get(i) - (double)expected.get(i)));
+		}
+		double gflop = 2.0 * out.length() * (trans_b[p] ? shapes_b[p][4] : shapes_b[p][3]) / 1e9;
+		printf("%-10s batched %8.2f ms (%6.2f GFLOP/s), one at a time %8.2f ms, max error %g\n",
+			names[p], 1e3 * batched, gflop / batched, 1e3 * single, error);
+	}
+}
+
+template<class T>
+void tensor::benchmark_small_gemm(int n_samples, int n_epochs) {
+	printf("tensor::benchmark_small_gemm() with %d-byte values\n", (int)sizeof(T));
+
+	// training epochs of the 13-11-7-3 sigmoid network of model::bp_network on
+	// batches of 60, with the small kernels and with every product packed
+	const int n_layers = 3, batch_size = 60;
+	int units[] = { 13, 11, 7, 3 };
+	Shape shape_x(1, 1, 1, n_samples, units[0]), shape_y(1, 1, 1, n_samples, units[n_layers]);
+	Tensor<T> x_train = Tensor<T>::random(shape_x);
+	Tensor<T> y_train = Tensor<T>::zeros(shape_y);
+	for (int i = 0; i < n_samples; i++) {
+		y_train.set((T)1, (int64_t)i * units[n_layers] + i % units[n_layers]);// one hot
+	}
+	vector<Shape> shapes_w, shapes_b;
+	vector<Tensor<T>> initial;
+	for (int l = 0; l < n_layers; l++) {
+		shapes_w.push_back(Shape(1, 1, 1, units[l], units[l + 1]));
+		shapes_b.push_back(Shape(1, 1, 1, 1, units[l + 1]));
+		initial.push_back(Tensor<T>::random(shapes_w[l]));
+	}
+	vector<Tensor<T>> trained[2];
+	for (int pass = 0; pass < 2; pass++) {
+		gemm::set_small_kernels(pass == 1);
+		vector<Tensor<T>> w, b;
+		for (int l = 0; l < n_layers; l++) {
+			w.push_back(Tensor<T>(shapes_w[l]));
+			memcpy(w[l].getData(), initial[l].getData(), w[l].size());
+			b.push_back(Tensor<T>::zeros(shapes_b[l]));
+		}
+		auto start = chrono::steady_clock::now();
+		for (int epoch = 0; epoch < n_epochs; epoch++) {
+			for (int first = 0; first < n_samples; first += batch_size) {
+				int rows = min(batch_size, n_samples - first);
+				Shape shape_in(1, 1, 1, rows, units[0]), shape_out(1, 1, 1, rows, units[n_layers]);
+				Tensor<T> x, y;
+				x.bind(x_train.getData() + (int64_t)first * units[0], shape_in);
+				y.bind(y_train.getData() + (int64_t)first * units[n_layers], shape_out);
+				// forward: fused matmul + bias + sigmoid per layer
+				vector<Tensor<T>> outputs;
+				outputs.push_back(Tensor<T>());
+				outputs[0].bind(x);
+				for (int l = 0; l < n_layers; l++) {
+					outputs.push_back(outputs[l].matmul(w[l], b[l], SIGMOID));
+				}
+				// backward: the transposed products of the gemm engine
+				Tensor<T> error = outputs[n_layers] - y;
+				Tensor<T> delta = error.activation_grad(outputs[n_layers], SIGMOID);
+				for (int l = n_layers - 1; l >= 0; l--) {
+					Tensor<T> grad_w = outputs[l].matmul(delta, true, false);
+					Tensor<T> grad_b = delta.reduce_sum(3);
+					if (l > 0) {
+						Tensor<T> back = delta.matmul(w[l], false, true);
+						delta = back.activation_grad(outputs[l], SIGMOID);
+					}
+					T *pw = w[l].getData(), *pb = b[l].getData();
+					const T *gw = grad_w.getData(), *gb = grad_b.getData();
+					for (int64_t i = 0; i < w[l].length(); i++) {
+						pw[i] -= (T)0.1 * gw[i];
+					}
+					for (int64_t i = 0; i < b[l].length(); i++) {
+						pb[i] -= (T)0.1 * gb[i];
+					}
+				}
+			}
+		}
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_epochs;
+		printf("%-7s %8.3f ms per epoch\n", (pass == 1) ? "small:" : "packed:", 1e3 * elapsed);
+		trained[pass].swap(w);
+	}
+	gemm::set_small_kernels(true);
+	double difference = 0;
+	for (int l = 0; l < n_layers; l++) {
+		for (int64_t i = 0; i < trained[0][l].length(); i++) {
+			difference = max(difference, fabs((double)trained[0][l].get(i) - (double)trained[1][l].get(i)));
+		}
+	}
+	printf("max difference of the trained weights %g\n", difference);
+}
+
+template<class T>
+void tensor::benchmark_epilogue(int n_samples, int n_runs) {
+	printf("tensor::benchmark_epilogue() with %d-byte values\n", (int)sizeof(T));
+
+	// tanh(0.5 * x * w + b + r) of a wide and of a tiny layer, as separate passes
+	// over the output and with every step in the gemm epilogue
+	int n_inputs[] = { 1024, 13 }, n_outputs[] = { 1024, 11 };
+	for (int p = 0; p < 2; p++) {
+		Shape shape_x(1, 1, 1, n_samples, n_inputs[p]), shape_w(1, 1, 1, n_inputs[p], n_outputs[p]);
+		Shape shape_b(1, 1, 1, 1, n_outputs[p]), shape_y(1, 1, 1, n_samples, n_outputs[p]);
+		Tensor<T> x = Tensor<T>::random(shape_x);
+		Tensor<T> w = Tensor<T>::random(shape_w);
+		Tensor<T> b = Tensor<T>::random(shape_b);
+		Tensor<T> r = Tensor<T>::random(shape_y);
+		Tensor<T> bias_rows(shape_y);// b repeated for the elementwise add
+		bias_rows.foreach_assign([&](int i, int j, int k, int l, int m) { return b.at(0, 0, 0, 0, m); });
+		Tensor<T> separate, fused;
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < n_runs; i++) {
+			Tensor<T> product = x.matmul(w);
+			Tensor<T> scaled = product * (T)0.5;
+			Tensor<T> biased = scaled + bias_rows;
+			Tensor<T> summed = biased + r;
+			separate = summed.tanh();
+		}
+		double before = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_runs;
+		start = chrono::steady_clock::now();
+		for (int i = 0; i < n_runs; i++) {
+			fused = x.matmul(w, Epilogue<T>(b.getData(), TANH, r.getData(), (T)0.5));
+		}
+		double after = chrono::duration<double>(chrono::steady_clock::now() - start).count() / n_runs;
+		double error = 0;
+		for (int64_t i = 0; i < fused.length(); i++) {
+			error = max(error, fabs((double)fused.get(i) - (double)separate.get(i)));
+		}
+		printf("(%d, %d) x (%d, %d): separate %8.3f ms, epilogue %8.3f ms, max error %g\n",
+			n_samples, n_inputs[p], n_inputs[p], n_outputs[p], 1e3 * before, 1e3 * after, error);
+	}
+}
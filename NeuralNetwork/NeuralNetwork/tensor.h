@@ -17,12 +17,17 @@
 #include <iomanip>
 #include <fstream>
 #include <map>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
 
 #include "shape.h"
-
-#ifndef RANDOM
-#define RANDOM ((rand() % 100) / 100.0)
-#endif // !RANDOM
+#include "allocator.h"
+#include "rng.h"
+#include "precision.h"
+#include "ranked.h"
+#include "permute.h"
+#include "gemm.h"
 
 // scalar function
 template<class T>
@@ -41,7 +46,7 @@ template<class T>
 inline T __pow_(T x, int y) { return pow(x, y); }
 
 template<class T>
-inline T __relu_(T x) { return ((x > 0) ? x : 0); }
+inline T __relu_(T x) { return ((x > 0) ? x : (T)0); }
 
 template<class T>
 inline T __relu_grad_(T x) { return ((x > 0) ? 1.0f : 0.0f); }
@@ -72,10 +77,155 @@ inline T __relu_grad_(T x, double max_value, double threshold, double negative_s
 	}
 }
 
+// activation of fused epilogues (conv/matmul + bias + activation)
+enum ActivationType { IDENTITY, SIGMOID, RELU, TANH, LEAKY_RELU };
+
+const double LEAKY_SLOPE = 0.1;// of LEAKY_RELU, the default of Tensor::relu(max_value)
+
+template<class T>
+inline T __activation_(T x, ActivationType activation) {
+	switch (activation) {
+	case SIGMOID: return __sigmoid_(x);
+	case RELU: return __relu_(x);
+	case TANH: return (T)std::tanh(x);
+	case LEAKY_RELU: return ((x > 0) ? x : (T)(LEAKY_SLOPE * x));
+	default: return x;
+	}
+}
+
+template<class T>
+inline T __activation_grad_(T y, ActivationType activation) {
+	// gradient expressed by the output y of the activation
+	switch (activation) {
+	case SIGMOID: return __sigmoid_grad_(y);
+	case RELU: return ((y > 0) ? 1 : 0);
+	case TANH: return 1 - y * y;
+	case LEAKY_RELU: return (T)((y > 0) ? 1.0 : LEAKY_SLOPE);
+	default: return 1;
+	}
+}
+
 namespace tensor {
 
 	using namespace std;
-	using namespace shape::oldshape;
+	using shape::Shape;
+	using shape::Index;
+	using shape::IndexIterator;
+
+	using precision::half;
+	using precision::bfloat16;
+
+	// type of sums and dot products, float is accumulated in double
+	// and the 16-bit types in float
+	template<class T> struct Accumulator { typedef T type; };
+	template<> struct Accumulator<float> { typedef double type; };
+	template<> struct Accumulator<half> { typedef float type; };
+	template<> struct Accumulator<bfloat16> { typedef float type; };
+
+	// file formats of save/load, load detects the format by the magic
+	enum FileFormat { TEXT, BINARY };
+
+	enum DataType { DT_UNKNOWN, DT_FLOAT32, DT_FLOAT64, DT_INT32, DT_UINT8, DT_FLOAT16, DT_BFLOAT16 };
+
+	// 64 bytes, so the payload following it is 64-byte aligned in the file
+	struct FileHeader {
+		char magic[4];// "TNSR"
+		unsigned int version;
+		unsigned int dtype;// DataType of the payload
+		unsigned int little_endian;// 1 if the payload is little-endian
+		long long dims[5];
+		unsigned long long n_bytes;// size of the payload
+	};
+
+	static_assert(sizeof(FileHeader) == 64, "FileHeader must be 64 bytes");
+
+	const char FILE_MAGIC[4] = { 'T', 'N', 'S', 'R' };
+	const unsigned int FILE_VERSION = 1;
+
+	template<class T>
+	inline DataType __dtype_() {
+		if (is_floating_point<T>::value) {
+			return (sizeof(T) == 4) ? DT_FLOAT32 : (sizeof(T) == 8) ? DT_FLOAT64 : DT_UNKNOWN;
+		}
+		if (is_integral<T>::value) {
+			return (sizeof(T) == 4) ? DT_INT32 : (sizeof(T) == 1) ? DT_UINT8 : DT_UNKNOWN;
+		}
+		return DT_UNKNOWN;
+	}
+	template<> inline DataType __dtype_<half>() { return DT_FLOAT16; }
+	template<> inline DataType __dtype_<bfloat16>() { return DT_BFLOAT16; }
+
+	inline int __dtype_size_(unsigned int dtype) {
+		switch (dtype) {
+		case DT_FLOAT32: case DT_INT32: return 4;
+		case DT_FLOAT64: return 8;
+		case DT_UINT8: return 1;
+		case DT_FLOAT16: case DT_BFLOAT16: return 2;
+		default: return 0;
+		}
+	}
+
+	inline bool __little_endian_() {
+		unsigned int one = 1;
+		return *(unsigned char*)&one == 1;
+	}
+
+	inline void __swap_bytes_(char *data, size_t elem_size, size_t n) {
+		// reverse the bytes of each element, only needed on big-endian hosts
+		for (size_t i = 0; i < n; i++) {
+			reverse(data + i * elem_size, data + (i + 1) * elem_size);
+		}
+	}
+
+	inline void __swap_header_(FileHeader &header) {
+		// the header is always stored little-endian
+		if (__little_endian_()) {
+			return;
+		}
+		__swap_bytes_((char*)&header.version, 4, 3);
+		__swap_bytes_((char*)header.dims, 8, 5);
+		__swap_bytes_((char*)&header.n_bytes, 8, 1);
+	}
+
+	template<class T>
+	inline T __read_elem_(const char *src, unsigned int dtype) {
+		// element of a payload of another dtype, converted to T
+		switch (dtype) {
+		case DT_FLOAT32: { float v; memcpy(&v, src, 4); return (T)v; }
+		case DT_FLOAT64: { double v; memcpy(&v, src, 8); return (T)v; }
+		case DT_INT32: { int v; memcpy(&v, src, 4); return (T)v; }
+		case DT_UINT8: return (T)(unsigned char)src[0];
+		case DT_FLOAT16: { uint16_t v; memcpy(&v, src, 2); return (T)precision::half_to_float(v); }
+		case DT_BFLOAT16: { uint16_t v; memcpy(&v, src, 2); return (T)precision::bfloat16_to_float(v); }
+		default: return (T)0;
+		}
+	}
+
+	// what the gemm engine applies to each value of a product while its tile is
+	// still in registers: activation(scale * sum + bias[j] + residual(i, j)).
+	// bias and residual may be null, residual has the layout of the output
+	template<class T>
+	struct Epilogue {
+		const T *bias;
+		ActivationType activation;
+		const T *residual;
+		T scale;
+		int64_t ld;// row length of residual, set by matmul
+		Epilogue(const T *bias = nullptr, ActivationType activation = IDENTITY,
+			const T *residual = nullptr, T scale = (T)1)
+			: bias(bias), activation(activation), residual(residual), scale(scale), ld(0) { ; }
+		template<class Acc>
+		inline T operator()(int i, int j, Acc value) const {
+			// value is already scaled, scale is the alpha of the gemm
+			if (bias != nullptr) {
+				value += (Acc)bias[j];
+			}
+			if (residual != nullptr) {
+				value += (Acc)residual[i * ld + j];
+			}
+			return __activation_((T)value, activation);
+		}
+	};
 	
 	// Tensor definition
 	template<class T>
@@ -84,16 +234,19 @@ namespace tensor {
 		// attributes
 		Shape shape;
 		T *data;
+		bool owner = true;// false for a view of a buffer owned elsewhere
 
 		// __allocate_
 		inline void __free_() {
-			if (data != nullptr) {
-				delete[] data;
+			if (data != nullptr && owner) {
+				memory::release(data);
 			}
+			data = nullptr;
+			owner = true;
 		}
 		inline void __allocate_() {
 			try {
-				data = new T[length()];
+				data = memory::allocate<T>(length());
 			} catch (const bad_alloc & e){
 				cerr << e.what() << endl;
 			}
@@ -101,7 +254,19 @@ namespace tensor {
 
 	protected:
 
-		Tensor<T> __foreach_assign_(Tensor<T> &tensor, function<T(T, T)> func) {
+		static void __check_matmul_(bool valid, const char *name) {
+			// a mismatch would make gemm read past the end of an operand
+			if (!valid) {
+				throw invalid_argument(string("Tensor::") + name + ": operand shapes do not match");
+			}
+		}
+		ranked::Matrix<T> __matrix_() {
+			// the last two axes of the first slice, the broadcast right operand of matmul
+			int size[] = { shape[3], shape[4] };
+			return ranked::Matrix<T>(data, size);
+		}
+		template<class Func>
+		Tensor<T> __foreach_assign_(Tensor<T> &tensor, Func func) {
 			Shape m_shape = tensor.getShape();
 			Tensor<T> out(m_shape);
 			int axis = -1;
@@ -145,15 +310,38 @@ namespace tensor {
 			}
 			return out;
 		}
-		Tensor<T> __foreach_elem_assign_(function<T(T)> func) {
+		template<class Func>
+		Tensor<T> __foreach_elem_assign_(Func func) {
 			Tensor<T> out(shape);
-			out.foreach_elem_assign([&](int i) {
+			out.foreach_elem_assign([&](auto i) {
 				return func(data[i]);
 			});
 			return out;
 		}
 
 		// pooling/upsampling
+		inline Tensor<T> __arg_pooling_(int width, bool maximum, vector<unsigned char> &index) {
+			int size[] = { shape[0], shape[1],	shape[2] / width, shape[3] / width,	shape[4] };
+			Shape output_shape(size);
+			Tensor<T> out(output_shape);
+			index.resize(out.length());
+			out.foreach_assign([&](int oi, int oj, int ok, int ol, int om) {
+				T value = this->at(oi, oj, ok*width, ol*width, om);
+				int best = 0;
+				for (int pk = 0; pk < width; pk++) {
+					for (int pl = 0; pl < width; pl++) {
+						T curr = this->at(oi, oj, ok*width + pk, ol*width + pl, om);
+						if (maximum ? (curr > value) : (curr < value)) {
+							value = curr;
+							best = pk * width + pl;
+						}
+					}
+				}
+				index[output_shape.sub2ind(oi, oj, ok, ol, om)] = (unsigned char)best;
+				return value;
+			});
+			return out;
+		}
 		inline Tensor<T> __pooling_(int width, T (*func)(T, T)) {
 			// 2d pooling (MAX, MIN, AVG)
 			int size[] = { shape[0], shape[1],	shape[2] / width, shape[3] / width,	shape[4] };
@@ -196,6 +384,11 @@ namespace tensor {
 				this->set(value, i, j, k, l, m);
 			});
 		}
+		Tensor(Tensor<T> &&tensor) : shape(tensor.shape), data(tensor.data), owner(tensor.owner) {
+			// steal the buffer, nothing is copied
+			tensor.data = nullptr;
+			tensor.owner = true;
+		}
 		~Tensor() {
 			__free_();
 		}
@@ -203,11 +396,78 @@ namespace tensor {
 		
 	public: // get & set methods
 		Shape getShape() const { return shape; }
-		int length() { return shape.size(); }
-		int size() { return (sizeof(T)*shape.size()); }
+		int64_t length() const { return shape.size(); }
+		size_t size() const { return sizeof(T) * (size_t)shape.size(); }
+		bool empty() const { return data == nullptr; }
+		T* getData() { return data; }
+		template<int Rank>
+		ranked::Ranked<T, Rank> as_ranked() {
+			// zero-copy view with the leading axes merged, e.g. as_ranked<2>() is a matrix
+			return ranked::Ranked<T, Rank>(data, shape);
+		}
+		template<int Rank>
+		void bind(ranked::Ranked<T, Rank> &view) {
+			// become a 5-D view of a ranked view, nothing is copied
+			Shape shape_in = view.getShape();
+			bind(view.getData(), shape_in);
+		}
+		bool isView() const { return !owner; }
+		bool isBatched() const { return shape[0] != 1 || shape[1] != 1 || shape[2] != 1; }
+		void bind(Tensor<T> &tensor) {
+			// become a view of the buffer of tensor, nothing is copied
+			if (this == &tensor) {
+				return;
+			}
+			__free_();
+			shape = tensor.shape;
+			data = tensor.data;
+			owner = false;
+		}
+		void bind(T *buffer, Shape &shape_in) {
+			// view of an external buffer, e.g. a memory-mapped file
+			__free_();
+			shape = shape_in;
+			data = buffer;
+			owner = false;
+		}
+		Tensor<T> view(int start, int end) {
+			// samples [start, end) as a view, samples are contiguous in memory
+			Tensor<T> out;
+			out.shape = shape;
+			out.shape.set(end - start, 0);
+			out.data = data + shape.sub2ind(start, 0, 0, 0, 0);
+			out.owner = false;
+			return out;
+		}
+		void clear() {
+			// release the buffer, the tensor becomes empty
+			__free_();
+			shape = Shape();
+		}
 
-		// non-parallel foreach
-		void foreach(function<void(int,int,int,int,int)> func) const {
+		int __rank_() const {
+			// the rank without the leading axes of 1, at least 2
+			int rank = 5;
+			while (rank > 2 && shape[5 - rank] == 1) {
+				rank--;
+			}
+			return rank;
+		}
+		// non-parallel foreach, a tensor with leading axes of 1 (a matrix is
+		// (1, 1, 1, h, c)) runs the unrolled loops of its rank
+		template<class Func>
+		void foreach(Func func) const {
+			switch (__rank_()) {
+			case 2:
+				ranked::Ranked<T, 2>(data, shape).foreach([&](int l, int m) { func(0, 0, 0, l, m); });
+				return;
+			case 3:
+				ranked::Ranked<T, 3>(data, shape).foreach([&](int k, int l, int m) { func(0, 0, k, l, m); });
+				return;
+			case 4:
+				ranked::Ranked<T, 4>(data, shape).foreach([&](int j, int k, int l, int m) { func(0, j, k, l, m); });
+				return;
+			}
 			for (int i = 0; i < shape[0]; i++) {// sample
 				for (int j = 0; j < shape[1]; j++) {// frame
 					for (int k = 0; k < shape[2]; k++) {// column(width)
@@ -220,27 +480,48 @@ namespace tensor {
 				}
 			}
 		}
-		void foreach_assign(function<T(int, int, int, int, int)> func) const {
+		template<class Func>
+		void foreach_assign(Func func) const {
+			// foreach visits the elements in memory order
+			switch (__rank_()) {
+			case 2:
+				ranked::Ranked<T, 2>(data, shape).foreach_assign([&](int l, int m) { return func(0, 0, 0, l, m); });
+				return;
+			case 3:
+				ranked::Ranked<T, 3>(data, shape).foreach_assign([&](int k, int l, int m) { return func(0, 0, k, l, m); });
+				return;
+			case 4:
+				ranked::Ranked<T, 4>(data, shape).foreach_assign([&](int j, int k, int l, int m) { return func(0, j, k, l, m); });
+				return;
+			}
+			T *p = data;
 			foreach([&](int i, int j, int k, int l, int m) {
-				int idx = shape.sub2ind(i, j, k, l, m);
-				data[idx] = func(i, j, k, l, m);
+				*p++ = func(i, j, k, l, m);
 			});
 		}
 		
-		// parallel foreach elem
+		// parallel foreach elem, func takes the index as auto: it is an int
+		// when every offset fits, which keeps the index math 32-bit on Win32
+		template<class Index, class Type>
+		void __foreach_elem_(Index len, Type func) {
+			for (Index i = 0; i < len; i++) {
+				func(i);
+			}
+		}
 		template<class Type>
 		void foreach_elem(Type func) {
-			int len = length();
-			for (int i = 0; i < len; i++) {
-				func(i);
+			if (shape.fits_int()) {
+				__foreach_elem_((int)length(), func);
+			}
+			else {
+				__foreach_elem_(length(), func);
 			}
 		}
 		template<class Type>
 		void foreach_elem_assign(Type func) {
-			int len = length();
-			for (int i = 0; i < len; i++) {
+			foreach_elem([&](auto i) {
 				data[i] = func(i);
-			}
+			});
 		}
 
 	public:
@@ -268,28 +549,104 @@ namespace tensor {
 			return (*this) - m;
 		}
 		Tensor<T> matmul(Tensor<T> &tensor) {
+			// this(:,:,:,row,col)*(1,1,1,col,:), the leading axes are merged into
+			// the rows of one matrix product, tensor is broadcast. a batched tensor
+			// gives one product per batch entry, see batch_matmul
+			if (tensor.isBatched()) {
+				return batch_matmul(tensor);
+			}
+			__check_matmul_(shape[4] == tensor.getShape()[3], "matmul");
+			Tensor<T> out(shape[0], shape[1], shape[2], shape[3], tensor.getShape()[4]);
+			gemm::gemm<T, typename Accumulator<T>::type>(as_ranked<2>(), false, tensor.__matrix_(), false, (T)1, (T)0, out.as_ranked<2>());
+			return out;
+		}
+		Tensor<T> matmul(Tensor<T> &tensor, bool trans_a, bool trans_b) {
+			// op(this) * op(tensor), both viewed as matrices with the leading axes
+			// merged into the rows and op transposing when its flag is set. the
+			// gradients of x * w are delta.matmul(w, false, true) for x and
+			// x.matmul(delta, true, false) for w, no transposed copy is built
+			ranked::Matrix<T> a = as_ranked<2>(), b = tensor.as_ranked<2>();
+			int N = trans_b ? b.dim(0) : b.dim(1);
+			Tensor<T> out = trans_a ? Tensor<T>(1, 1, 1, a.dim(1), N) : Tensor<T>(shape[0], shape[1], shape[2], shape[3], N);
+			matmul(tensor, trans_a, trans_b, (T)1, (T)0, out);
+			return out;
+		}
+		Tensor<T> batch_matmul(Tensor<T> &tensor, bool trans_a = false, bool trans_b = false) {
+			// op(this(i,j,k,:,:)) * op(tensor(i,j,k,:,:)) for every entry of the batch
+			// axes 0-2, an axis of size 1 in either operand is broadcast, e.g. the
+			// attention scores q.batch_matmul(k, false, true)
+			return batch_matmul(tensor, trans_a, trans_b, Epilogue<T>());
+		}
+		Tensor<T> batch_matmul(Tensor<T> &tensor, bool trans_a, bool trans_b, const Epilogue<T> &epilogue) {
 			Shape shape_b = tensor.getShape();
-			// calculate this(:,:,:,ok,col)*(1,1,1,col,ol)
-			int n_cols = shape[3];
-			Tensor<T> out(shape[0], shape[1], shape[2], shape[3], shape_b[4]);
-			out.foreach_assign([&](int oi, int oj, int ok, int ol, int om) {
-				T value = 0;
-				for (int k = 0; k < n_cols; k++) {
-					value += this->at(oi, oj, ok, ol, k)*tensor.at(0, 0, 0, k, om);// broadcast
-				}
-				return value;
-			});
+			int M = trans_a ? shape[4] : shape[3], K = trans_a ? shape[3] : shape[4];
+			int N = trans_b ? shape_b[3] : shape_b[4];
+			bool valid = K == (trans_b ? shape_b[4] : shape_b[3]);
+			for (int i = 0; i < 3; i++) {
+				valid = valid && (shape[i] == shape_b[i] || shape[i] == 1 || shape_b[i] == 1);
+			}
+			__check_matmul_(valid, "batch_matmul");
+			Shape shape_batch(max(shape[0], shape_b[0]), max(shape[1], shape_b[1]), max(shape[2], shape_b[2]), 1, 1);
+			Tensor<T> out(shape_batch[0], shape_batch[1], shape_batch[2], M, N);
+			// offsets of the matrices of each entry, 0 stride along broadcast axes
+			int64_t layout_a[5] = { 0 }, layout_b[5] = { 0 };
+			for (int i = 0; i < 3; i++) {
+				layout_a[i] = (shape[i] == 1) ? 0 : shape.stride(i);
+				layout_b[i] = (shape_b[i] == 1) ? 0 : shape_b.stride(i);
+			}
+			int batch = (int)shape_batch.size();
+			// a tensor, so the buffer comes from the memory pool of the session
+			Shape offsets_shape(1, 1, 1, 2, batch);
+			Tensor<int64_t> offsets(offsets_shape);
+			int64_t *offset_a = offsets.getData(), *offset_b = offset_a + batch;
+			IndexIterator it_a(shape_batch, layout_a), it_b(shape_batch, layout_b);
+			for (int i = 0; i < batch; i++, it_a.next(), it_b.next()) {
+				offset_a[i] = it_a.getOffset();
+				offset_b[i] = it_b.getOffset();
+			}
+			Epilogue<T> tile = epilogue;
+			tile.ld = N;
+			gemm::gemm_batched<T, typename Accumulator<T>::type>(batch, offset_a, offset_b, (int64_t)M * N,
+				trans_a, trans_b, M, N, K, epilogue.scale, data, shape[4], tensor.getData(), shape_b[4], (T)0, out.getData(), N, tile);
 			return out;
 		}
-		Tensor<T> Transpose() {
-			Shape output_shape(shape[0], shape[1], shape[2], shape[4], shape[3]);
-			output_shape.print();
-			Tensor<T> out(output_shape);
-			out.foreach_assign([&](int i, int j, int k, int l, int m) {
-				return this->at(i, j, k, m, l);
-			});
+		void matmul(Tensor<T> &tensor, bool trans_a, bool trans_b, T alpha, T beta, Tensor<T> &out) {
+			// out = alpha * op(this) * op(tensor) + beta * out, out is not read when beta is 0
+			ranked::Matrix<T> a = as_ranked<2>(), b = tensor.as_ranked<2>(), c = out.as_ranked<2>();
+			int M = trans_a ? a.dim(1) : a.dim(0), K = trans_a ? a.dim(0) : a.dim(1);
+			int N = trans_b ? b.dim(0) : b.dim(1);
+			__check_matmul_(K == (trans_b ? b.dim(1) : b.dim(0)) && M == c.dim(0) && N == c.dim(1), "matmul");
+			gemm::gemm<T, typename Accumulator<T>::type>(a, trans_a, b, trans_b, alpha, beta, c);
+		}
+		Tensor<T> matmul(Tensor<T> &tensor, Tensor<T> &bias, ActivationType activation) {
+			// fused matmul + bias + activation, one write of the output
+			return matmul(tensor, Epilogue<T>(bias.getData(), activation));
+		}
+		Tensor<T> matmul(Tensor<T> &tensor, const Epilogue<T> &epilogue) {
+			// matmul with the epilogue applied to each tile in registers, e.g. a
+			// layer with a skip connection Epilogue<T>(b, RELU, x.getData())
+			if (tensor.isBatched()) {
+				return batch_matmul(tensor, false, false, epilogue);
+			}
+			int N = tensor.getShape()[4];
+			__check_matmul_(shape[4] == tensor.getShape()[3], "matmul");
+			Tensor<T> out(shape[0], shape[1], shape[2], shape[3], N);
+			Epilogue<T> tile = epilogue;
+			tile.ld = N;
+			gemm::gemm<T, typename Accumulator<T>::type>(as_ranked<2>(), false, tensor.__matrix_(), false, epilogue.scale, (T)0, out.as_ranked<2>(), tile);
 			return out;
 		}
+		Tensor<T> activation_grad(Tensor<T> &y, ActivationType activation) {
+			// delta * f'(y) in one pass, y is the output of the activation
+			return __foreach_assign_(y, [=](T d, T v) {
+				return d * __activation_grad_(v, activation);
+			});
+		}
+		Tensor<T> Transpose() {
+			// swap the last two axes
+			int order[] = { 0, 1, 2, 4, 3 };
+			return permute(order);
+		}
 		Tensor<T> permute(int order[]) {
 			// get new shape
 			int size[] = { 0, 0, 0, 0, 0 };
@@ -297,17 +654,9 @@ namespace tensor {
 				size[i] = shape[order[i]];
 			}
 			Shape shape_out(size);
-			Tensor<T> out = Tensor<T>::zeros(shape_out);
-			// permute
-			out.foreach_assign([&](int i, int j, int k, int l, int m) {
-				int subs[] = { 0, 0, 0, 0, 0 };
-				subs[order[0]] = i;
-				subs[order[1]] = j;
-				subs[order[2]] = k;
-				subs[order[3]] = l;
-				subs[order[4]] = m;
-				return this->at(subs[0], subs[1], subs[2], subs[3], subs[4]);
-			});
+			Tensor<T> out(shape_out);
+			// blocked transposes in registers, every element is written once
+			permute::permute(data, shape, order, out.data);
 			return out;
 		}
 		Tensor<T> reshape(int size[]) {
@@ -317,11 +666,18 @@ namespace tensor {
 		Tensor<T> reshape(Shape &shape_out) {
 			Tensor<T> out = Tensor<T>::zeros(shape_out);
 			out.foreach_assign([&](int i, int j, int k, int l, int m) {
-				int idx = shape_out.sub2ind(i, j, k, l, m);
+				int64_t idx = shape_out.sub2ind(i, j, k, l, m);
 				return data[idx];
 			});
 			return out;
 		}
+		template<class S>
+		Tensor<S> cast() {
+			// the values converted to S, vectorized between float and the 16-bit types
+			Tensor<S> out(shape);
+			precision::convert(data, out.getData(), length());
+			return out;
+		}
 		Tensor<T> flatten(int dim = 2) {
 			// merge last two dimensions by default
 			Shape shape_out = shape;
@@ -332,39 +688,35 @@ namespace tensor {
 			Shape shape_out = shape;
 			shape_out.set(1, dim);
 			Tensor<T> out = Tensor<T>::zeros(shape_out);
-			switch (dim) {
-			case 0:// samples
-				foreach([&](int i, int j, int k, int l, int m) {
-					T value = out.at(0, j, k, l, m) + this->at(i, j, k, l, m);
-					out.set(value, 0, j, k, l, m);
-				});
-			case 1:// frame
-				foreach([&](int i, int j, int k, int l, int m) {
-					T value = out.at(i, 0, k, l, m) + this->at(i, j, k, l, m);
-					out.set(value, i, 0, k, l, m);
-				});
-				break;
-			case 2:// width
-				foreach([&](int i, int j, int k, int l, int m) {
-					T value = out.at(i, j, 0, l, m) + this->at(i, j, k, l, m);
-					out.set(value, i, j, 0, l, m);
-				});
-				break;
-			case 3:// height
-				foreach([&](int i, int j, int k, int l, int m) {
-					T value = out.at(i, j, k, 0, m) + this->at(i, j, k, l, m);
-					out.set(value, i, j, k, 0, m);
-				});
-				break;
-			case 4:// channel
-				foreach([&](int i, int j, int k, int l, int m) {
-					T value = out.at(i, j, k, l, 0) + this->at(i, j, k, l, m);
-					out.set(value, i, j, k, l, 0);
-				});
-				break;
-			default:
+			if (dim < 0 || dim > 4) {
 				cout << "error in reduce sum" << endl;
-				break;
+				return out;
+			}
+			// summed in the accumulator type, then stored. the sums are a tensor so
+			// the buffer comes from the memory pool of the session
+			// the strides of the output with 0 along dim map every element to its sum
+			Tensor<typename Accumulator<T>::type> sums = Tensor<typename Accumulator<T>::type>::zeros(shape_out);
+			int64_t layout[5];
+			for (int i = 0; i < 5; i++) {
+				layout[i] = (i == dim) ? 0 : shape_out.stride(i);
+			}
+			const T *p = data;
+			for (IndexIterator it(shape, layout); it.valid(); it.next()) {
+				sums.getData()[it.getOffset()] += *p++;
+			}
+			for (int64_t i = 0; i < out.length(); i++) {
+				out.set((T)sums.getData()[i], i);
+			}
+			return out;
+		}
+		Tensor<T> reduce_to(Shape &shape_out) {
+			// sum over the broadcast dimensions (size 1 in shape_out)
+			Tensor<T> out = (*this);
+			for (int i = 0; i < 5; i++) {
+				if (shape_out[i] == 1 && shape[i] != 1) {
+					Tensor<T> sum = out.reduce_sum(i);
+					out = sum;
+				}
 			}
 			return out;
 		}
@@ -376,11 +728,11 @@ namespace tensor {
 		Tensor<T> reduce_mean() {
 			Shape shape_out(1, 1, 1, 1, 1);
 			Tensor<T> out = Tensor<T>::zeros(shape_out);
-			T value = 0;
-			foreach_elem([&](int i) {
+			typename Accumulator<T>::type value = 0;
+			foreach_elem([&](auto i) {
 				value += data[i];
 			});
-			out.set(value, 0);
+			out.set((T)value, 0);
 			return out;
 		}
 		
@@ -407,7 +759,7 @@ namespace tensor {
 		// find min/max value
 		T find_min() {
 			T value = data[0];
-			foreach_elem([&](int i) {
+			foreach_elem([&](auto i) {
 				if (data[i] < value) {
 					value = data[i];
 				}
@@ -416,7 +768,7 @@ namespace tensor {
 		}
 		T find_max() {
 			T value = data[0];
-			foreach_elem([&](int i) {
+			foreach_elem([&](auto i) {
 				if (data[i] > value) {
 					value = data[i];
 				}
@@ -425,23 +777,23 @@ namespace tensor {
 		}
 
 		// operator ()
-		inline void set(T value, int i) {
+		inline void set(T value, int64_t i) {
 			data[i] = value;
 		}
 		inline void set(T value, int i, int j, int k, int l, int m) {
-			int idx = shape.sub2ind(i, j, k, l, m);
+			int64_t idx = shape.sub2ind(i, j, k, l, m);
 			data[idx] = value;
 		}
 		inline T at(int i, int j, int k, int l, int m) const {
-			int idx = shape.sub2ind(i, j, k, l, m);
+			int64_t idx = shape.sub2ind(i, j, k, l, m);
 			return data[idx];
 		}
 		inline T at(int l) {
-			int idx = shape.sub2ind(0, 0, 0, 0, l);
+			int64_t idx = shape.sub2ind(0, 0, 0, 0, l);
 			return data[idx];
 		}
 
-		inline T get(int idx) const { return data[idx]; }
+		inline T get(int64_t idx) const { return data[idx]; }
 		
 	public:
 		// rotate operation
@@ -485,6 +837,21 @@ namespace tensor {
 		}
 
 		// convolution operation
+		inline T __conv_sum_(Tensor<T> &filter, int oi, int oj, int ok, int ol, int om, int stride) {
+			// sum of this(oi, oj, ok*stride:, ol*stride:, :) * filter(om, :, :, :, :)
+			Shape filter_shape = filter.getShape();
+			typename Accumulator<T>::type value = 0;
+			for (int kj = 0; kj < filter_shape[1]; kj++) {
+				for (int kk = 0; kk < filter_shape[2]; kk++) {
+					for (int kl = 0; kl < filter_shape[3]; kl++) {
+						for (int km = 0; km < filter_shape[4]; km++) {
+							value += this->at(oi, oj, ok*stride + kk, ol*stride + kl, km)*filter.at(om, kj, kk, kl, km);
+						}
+					}
+				}
+			}
+			return (T)value;
+		}
 		Tensor<T> conv2d(Tensor<T> &filter, Tensor<T> &bias, int stride) {
 
 			// output shape (n_samples, 1, width, height, channel)
@@ -495,41 +862,52 @@ namespace tensor {
 			int height = (shape[3] - filter_shape[3]) / stride + 1;
 			int n_channels = filter_shape[0];// number of channels
 			Shape output_shape(n_samples, n_frames, width, height, n_channels);
-			
-			// for unit test
-			int before[] = { 0, 1, 4, 2, 3 };
-			int count = filter_shape[1] * filter_shape[2] * filter_shape[3] * filter_shape[4];
 
 			// calculate 2d concolution
+			// (n_samples,1,:,:,n_channels)*(n_filters,1,:,:,n_channels)
+			Tensor<T> out(output_shape);
+			out.foreach_assign([&](int oi, int oj, int ok, int ol, int om) {
+				return __conv_sum_(filter, oi, oj, ok, ol, om, stride) + bias.at(om);
+			});
 #ifdef DEBUG
-			cout << "<---------------------------------" << endl;
+			// for unit test
+			int before[] = { 0, 1, 4, 2, 3 };
+			out.permute(before).print();
 #endif // DEBUG
-			std::vector<T> list;
-			Tensor<T> out = Tensor<T>::zeros(output_shape);
+			return out;
+		}
+		Tensor<T> conv2d(Tensor<T> &filter, Tensor<T> &bias, int stride,
+			ActivationType activation, int pooling, vector<unsigned char> &argmax) {
+
+			// fused conv2d + bias + activation (+ max pooling of width pooling),
+			// only the (pooled) output is written. pooling before the activation
+			// is exact for monotone activations (RELU, IDENTITY).
+			Shape filter_shape = filter.getShape();
+			int width = (shape[2] - filter_shape[2]) / stride + 1;
+			int height = (shape[3] - filter_shape[3]) / stride + 1;
+			Shape output_shape(shape[0], shape[1], width / pooling, height / pooling, filter_shape[0]);
+			Tensor<T> out(output_shape);
+			if (pooling > 1) {
+				argmax.resize(out.length());
+			}
 			out.foreach([&](int oi, int oj, int ok, int ol, int om) {
-				if (om == 0) {// channel					
-					// (n_samples,1,:,:,n_channels)*(n_filters,1,:,:,n_channels)
-					filter.foreach([&](int ki, int kj, int kk, int kl, int km) {
-						// (1, frame, width, height, channel)		
-						T a = this->at(oi, oj, ok*stride + kk, ol*stride + kl, km);
-						T b = filter.at(ki, kj, kk, kl, km);
-						list.push_back(a * b);
-						if (list.size() == count) {
-							T value = accumulate(list.begin(), list.end(), 0);
-							T z = bias.at(ki);
-							out.set(value + z, oi, oj, ok, ol, ki);
-#ifdef DEBUG
-							cout << "---------------------------------" << endl;
-							out.permute(before).print();
-#endif // DEBUG
-							list.clear();
+				T value = 0;
+				int index = 0;
+				for (int pk = 0; pk < pooling; pk++) {
+					for (int pl = 0; pl < pooling; pl++) {
+						T z = __conv_sum_(filter, oi, oj, ok*pooling + pk, ol*pooling + pl, om, stride);
+						z += bias.at(0, 0, 0, 0, om);
+						if ((pk == 0 && pl == 0) || z > value) {
+							value = z;
+							index = pk * pooling + pl;
 						}
-					});
+					}
+				}
+				if (pooling > 1) {
+					argmax[output_shape.sub2ind(oi, oj, ok, ol, om)] = (unsigned char)index;
 				}
+				out.set(__activation_(value, activation), oi, oj, ok, ol, om);
 			});
-#ifdef DEBUG
-			cout << "--------------------------------->" << endl;
-#endif // DEBUG
 			return out;
 		}
 		Tensor<T> conv2d(Tensor<T> &filter, int stride) {
@@ -543,27 +921,70 @@ namespace tensor {
 			int n_channels = filter_shape[0];// number of channels
 			Shape output_shape(n_samples, n_frames, width, height, n_channels);
 
-			// for unit test
-			int before[] = { 0, 1, 4, 2, 3 };
-			int count = filter_shape[1] * filter_shape[2] * filter_shape[3] * filter_shape[4];
-
 			// calculate 2d concolution
-			std::vector<T> list;
-			Tensor<T> out = Tensor<T>::zeros(output_shape);
-			out.foreach([&](int oi, int oj, int ok, int ol, int om) {
-				if (om == 0) {
-					// (1, frame, width, height, channel)		
-					filter.foreach([&](int ki, int kj, int kk, int kl, int km) {
-						T a = this->at(oi, oj, ok*stride + kk, ol*stride + kl, km);
-						T b = filter.at(ki, kj, kk, kl, km);
-						list.push_back(a * b);
-						if (list.size() == count) {
-							T value = accumulate(list.begin(), list.end(), 0);
-							out.set(value, oi, oj, ok, ol, ki);
-							list.clear();
+			Tensor<T> out(output_shape);
+			out.foreach_assign([&](int oi, int oj, int ok, int ol, int om) {
+				return __conv_sum_(filter, oi, oj, ok, ol, om, stride);
+			});
+			return out;
+		}
+		Tensor<T> conv2d_grad_filter(Tensor<T> &delta, Shape &filter_shape, int stride, int padding) {
+			// gradient of padding(padding).conv2d with respect to the filter, this is
+			// the input: the input patch of each output position times its delta,
+			// summed over samples, frames and positions. the forward pass adds
+			// every filter frame to the same input frame, so each frame gets the sum
+			if (padding > 0) {
+				return this->padding(padding).conv2d_grad_filter(delta, filter_shape, stride, 0);
+			}
+			Shape delta_shape = delta.getShape();
+			Tensor<T> out(filter_shape);
+			out.foreach_assign([&](int om, int kj, int kk, int kl, int km) {
+				typename Accumulator<T>::type value = 0;
+				for (int oi = 0; oi < delta_shape[0]; oi++) {
+					for (int oj = 0; oj < delta_shape[1]; oj++) {
+						for (int ok = 0; ok < delta_shape[2]; ok++) {
+							for (int ol = 0; ol < delta_shape[3]; ol++) {
+								value += this->at(oi, oj, ok*stride + kk, ol*stride + kl, km) * delta.at(oi, oj, ok, ol, om);
+							}
 						}
-					});
+					}
 				}
+				return (T)value;
+			});
+			return out;
+		}
+		Tensor<T> conv2d_grad_input(Tensor<T> &filter, Shape &input_shape, int stride, int padding) {
+			// gradient of padding(padding).conv2d with respect to its input of
+			// input_shape, this is the delta: every output position the padded input
+			// element is read by, times the filter weight it is read with
+			if (padding > 0) {
+				Shape padded_shape(input_shape[0], input_shape[1],
+					input_shape[2] + padding * 2, input_shape[3] + padding * 2, input_shape[4]);
+				return conv2d_grad_input(filter, padded_shape, stride, 0).clipping(padding);
+			}
+			Shape filter_shape = filter.getShape();
+			Tensor<T> out(input_shape);
+			out.foreach_assign([&](int oi, int oj, int ik, int il, int km) {
+				typename Accumulator<T>::type value = 0;
+				for (int kk = ik % stride; kk < filter_shape[2] && kk <= ik; kk += stride) {
+					int ok = (ik - kk) / stride;
+					if (ok >= shape[2]) {
+						continue;
+					}
+					for (int kl = il % stride; kl < filter_shape[3] && kl <= il; kl += stride) {
+						int ol = (il - kl) / stride;
+						if (ol >= shape[3]) {
+							continue;
+						}
+						for (int om = 0; om < filter_shape[0]; om++) {
+							T d = this->at(oi, oj, ok, ol, om);
+							for (int kj = 0; kj < filter_shape[1]; kj++) {
+								value += d * filter.at(om, kj, kk, kl, km);
+							}
+						}
+					}
+				}
+				return (T)value;
 			});
 			return out;
 		}
@@ -578,40 +999,28 @@ namespace tensor {
 			int n_filters = filter_shape[0];
 			Shape output_shape(n_samples, n_frames, width, height, n_filters);
 
-			// for unit test
-			int before[] = { 0, 1, 4, 2, 3 };
-			int count = filter_shape[1] * filter_shape[2] * filter_shape[3] * filter_shape[4];
-
-#ifdef DEBUG
-			cout << "<---------------------------------" << endl;
-#endif // DEBUG
 			// calculate 3d concolution	
-			std::vector<T> list;
-			Tensor<T> out = Tensor<T>::zeros(output_shape);
-			out.foreach([&](int oi, int oj, int ok, int ol, int om) {
-				if (om == 0) {// channel
-					int index = 1; T value = 0;
-					// (n_samples,:,:,:,n_channels)*(n_filters,:,:,:,n_channels)
-					filter.foreach([&](int ki, int kj, int kk, int kl, int km) {
-						// (1, frame, width, height, channel)
-						T a = this->at(oi, oj*stride + kj, ok*stride + kk, ok*stride + kl, km);
-						T b = filter.at(ki, kj, kk, kl, km);
-						list.push_back(a * b);
-						if (list.size() == count) {
-							T value = accumulate(list.begin(), list.end(), 0);
-							T z = bias.at(ki);
-							out.set(value + z, oi, oj, ok, ol, ki);
-#ifdef DEBUG
-							cout << "---------------------------------" << endl;
-							out.permute(before).print();
-#endif // DEBUG
-							list.clear();
+			// (n_samples,:,:,:,n_channels)*(n_filters,:,:,:,n_channels)
+			Tensor<T> out(output_shape);
+			out.foreach_assign([&](int oi, int oj, int ok, int ol, int om) {
+				T value = bias.at(om);
+				for (int kj = 0; kj < filter_shape[1]; kj++) {
+					for (int kk = 0; kk < filter_shape[2]; kk++) {
+						for (int kl = 0; kl < filter_shape[3]; kl++) {
+							for (int km = 0; km < filter_shape[4]; km++) {
+								// (1, frame, width, height, channel)
+								T a = this->at(oi, oj*stride + kj, ok*stride + kk, ol*stride + kl, km);
+								value += a * filter.at(om, kj, kk, kl, km);
+							}
 						}
-					});
+					}
 				}
+				return value;
 			});
 #ifdef DEBUG
-			cout << "--------------------------------->" << endl;
+			// for unit test
+			int before[] = { 0, 1, 4, 2, 3 };
+			out.permute(before).print();
 #endif // DEBUG
 			return out;
 		}
@@ -628,6 +1037,22 @@ namespace tensor {
 			double area = (width*width);
 			return out / area;
 		}
+		Tensor<T> max_pooling(int width, vector<unsigned char> &argmax) {
+			// also saves the position pk * width + pl of the max of each window
+			return __arg_pooling_(width, true, argmax);
+		}
+		Tensor<T> min_pooling(int width, vector<unsigned char> &argmin) {
+			return __arg_pooling_(width, false, argmin);
+		}
+		Tensor<T> unpooling(Shape &input_shape, int width, vector<unsigned char> &index) {
+			// route each value back to the saved position of its pooling window
+			Tensor<T> out = Tensor<T>::zeros(input_shape);
+			foreach([&](int i, int j, int k, int l, int m) {
+				int p = index[shape.sub2ind(i, j, k, l, m)];
+				out.set(this->at(i, j, k, l, m), i, j, k*width + p / width, l*width + p % width, m);
+			});
+			return out;
+		}
 
 		// kronecker
 		Tensor<T> kronecker(Tensor<T> &tensor) {
@@ -717,14 +1142,13 @@ namespace tensor {
 		Tensor<T> hinge(T t) {
 			return __foreach_elem_assign_([=](T x) {
 				T y = 1 - t * x;
-				return ((y > 0) ? y : 0);
+				return ((y > 0) ? y : (T)0);
 			});
 		}
 		Tensor<T> tanh() {
+			// std::tanh, exp(x) / exp(-x) overflows float for |x| > 88
 			return __foreach_elem_assign_([=](T x) {
-				T exp_p = __exp_(x);
-				T exp_n = __exp_(-x);
-				return ((exp_p - exp_n) / (exp_p + exp_n));
+				return (T)std::tanh(x);
 			});
 		}
 		Tensor<T> neg() {
@@ -733,9 +1157,8 @@ namespace tensor {
 			});
 		}
 		Tensor<T> randomize() {
-			foreach_elem_assign([](int i) {
-				return RANDOM;
-			});
+			// uniform [0, 1) from the next stream of the global seed
+			rng::fill_uniform(data, length(), 0.0, 1.0, rng::get_seed(), rng::next_stream());
 			return (*this);
 		}
 
@@ -780,19 +1203,36 @@ namespace tensor {
 		
 		// matrix operation
 		Tensor<T>& operator=(Tensor<T> &tensor) {			
-			if (length() != tensor.length()) {
-				shape = tensor.getShape();
+			if (this == &tensor) {
+				return (*this);
+			}
+			// a view never writes through to the buffer it refers to
+			if (length() != tensor.length() || !owner || data == nullptr) {
 				__free_();
+				shape = tensor.getShape();
 				__allocate_();
 			}
+			shape = tensor.getShape();
 			this->foreach_assign([&](int ii, int ij, int ik, int il, int im) {
 				return tensor.at(ii, ij, ik, il, im);
 			});
 			return (*this);
 		}
+		Tensor<T>& operator=(Tensor<T> &&tensor) {
+			// take over the buffer of a temporary
+			if (this != &tensor) {
+				__free_();
+				shape = tensor.shape;
+				data = tensor.data;
+				owner = tensor.owner;
+				tensor.data = nullptr;
+				tensor.owner = true;
+			}
+			return (*this);
+		}
 		bool operator ==(Tensor<T> &a) {
 			bool result = true;
-			foreach_elem([&](int i) {
+			foreach_elem([&](auto i) {
 				if (fabs(this->get(i) - a.get(i)) > 10e-6) {
 					result = false;
 				}
@@ -806,7 +1246,7 @@ namespace tensor {
 				if (l == 0 && m == 0) {
 					printf("Tensor (%d, %d, %d :, :)\n", i, j, k);
 				}
-				printf("%5.2f\t", this->at(i, j, k, l, m));
+				printf("%5.2f\t", (double)this->at(i, j, k, l, m));
 				if (m == shape[4] - 1) {
 					printf("\n");
 				}
@@ -815,29 +1255,44 @@ namespace tensor {
 
 		// static method
 		static Tensor<T> random(Shape &shape) {
+			return uniform(shape, 0.0, 1.0);
+		}
+		static Tensor<T> uniform(Shape &shape, double low, double high) {
 			Tensor<T> out(shape);
-			out.foreach_elem_assign([&](int i) {
-				return RANDOM;
-			});
+			rng::fill_uniform(out.data, out.length(), low, high, rng::get_seed(), rng::next_stream());
 			return out;
 		}
+		static Tensor<T> normal(Shape &shape, double mean, double stddev) {
+			Tensor<T> out(shape);
+			rng::fill_normal(out.data, out.length(), mean, stddev, rng::get_seed(), rng::next_stream());
+			return out;
+		}
+		static Tensor<T> xavier(Shape &shape, int fan_in, int fan_out) {
+			// Glorot & Bengio, uniform with variance 2 / (fan_in + fan_out)
+			double limit = sqrt(6.0 / (fan_in + fan_out));
+			return uniform(shape, -limit, limit);
+		}
+		static Tensor<T> he(Shape &shape, int fan_in) {
+			// He et al., normal with variance 2 / fan_in, for ReLU layers
+			return normal(shape, 0.0, sqrt(2.0 / fan_in));
+		}
 		static Tensor<T> numbers(Shape &shape, T value) {
 			Tensor<T> out(shape);
-			out.foreach_elem_assign([&](int i) {
+			out.foreach_elem_assign([&](auto i) {
 				return value;
 			});
 			return out;
 		}
 		static Tensor<T> ones(Shape &shape) {
 			Tensor<T> out(shape);
-			out.foreach_elem_assign([&](int i) {
+			out.foreach_elem_assign([&](auto i) {
 				return 1;
 			});
 			return out;
 		}
 		static Tensor<T> zeros(Shape &shape) {
 			Tensor<T> out(shape);
-			out.foreach_elem_assign([](int i) {
+			out.foreach_elem_assign([](auto i) {
 				return 0;
 			});
 			return out;
@@ -852,35 +1307,134 @@ namespace tensor {
 			return out;
 		}
 		static Tensor<T> mask(Shape &shape, double rate) {
-			Tensor<T> out = Tensor<T>::ones(shape);
-			out.foreach_elem_assign([=](int i) {
-				return (RANDOM < rate) ? 0 : 1;
+			// 0 with probability rate, 1 otherwise
+			Tensor<T> out = Tensor<T>::random(shape);
+			T *p = out.data;
+			parallel::parallel_for(0, out.length(), [=](int64_t first, int64_t last) {
+				for (int64_t i = first; i < last; i++) {
+					p[i] = (p[i] < rate) ? 0 : 1;
+				}
 			});
 			return out;
 		}
 
 		// file input/output
-		void load(string path) {
+		bool load(string path) {
 			ifstream inf;
-			inf.open(path, ios::in);
+			inf.open(path, ios::in | ios::binary);
+			bool ok = false;
 			if (inf.is_open()) {
-				inf >> (*this);
+				char magic[4] = { 0 };
+				inf.read(magic, 4);
+				bool binary = inf.gcount() == 4 && memcmp(magic, FILE_MAGIC, 4) == 0;
+				inf.clear();
+				inf.seekg(0);
+				if (binary) {
+					ok = read_binary(inf);
+				}
+				else {
+					ok = (bool)(inf >> (*this));
+				}
 				inf.close();
 			}
+			return ok;
 		}
-		void save(string path) {
+		void save(string path, FileFormat format = TEXT) {
 			ofstream outf;
-			outf.open(path, ios::out);
+			outf.open(path, (format == BINARY) ? (ios::out | ios::binary) : ios::out);
 			if (outf.is_open()) {
-				outf << (*this);
+				if (format == BINARY) {
+					write_binary(outf);
+				}
+				else {
+					outf << (*this);
+				}
 				outf.close();
 			}
 		}
+		bool read_binary(istream &in) {
+			// header, then the payload is read straight into the buffer
+			FileHeader header;
+			in.read((char*)&header, sizeof(FileHeader));
+			__swap_header_(header);
+			if (!in || memcmp(header.magic, FILE_MAGIC, 4) != 0 || header.version > FILE_VERSION) {
+				cerr << "Tensor::read_binary: not a tensor file of a supported version" << endl;
+				return false;
+			}
+			int elem_size = __dtype_size_(header.dtype);
+			int size[5];
+			for (int i = 0; i < 5; i++) {
+				size[i] = (int)header.dims[i];
+			}
+			Shape shape_in(size);
+			if (elem_size == 0 || header.n_bytes != (unsigned long long)shape_in.size() * elem_size) {
+				cerr << "Tensor::read_binary: unknown dtype or truncated header" << endl;
+				return false;
+			}
+			if (!owner || length() != shape_in.size()) {
+				__free_();
+				shape = shape_in;
+				__allocate_();
+			}
+			shape = shape_in;
+			bool swap = (header.little_endian == 1) != __little_endian_();
+			if (header.dtype == __dtype_<T>()) {
+				in.read((char*)data, header.n_bytes);
+				if (swap) {
+					__swap_bytes_((char*)data, elem_size, length());
+				}
+			}
+			else {
+				// stored as another dtype, convert element by element
+				vector<char> payload(header.n_bytes);
+				in.read(payload.data(), header.n_bytes);
+				if (swap) {
+					__swap_bytes_(payload.data(), elem_size, length());
+				}
+				for (int64_t i = 0; i < length(); i++) {
+					data[i] = __read_elem_<T>(payload.data() + (size_t)i * elem_size, header.dtype);
+				}
+			}
+			if (!in) {
+				cerr << "Tensor::read_binary: payload is truncated" << endl;
+				return false;
+			}
+			return true;
+		}
+		bool write_binary(ostream &out) {
+			// 64-byte header and the raw little-endian payload
+			FileHeader header;
+			memset(&header, 0, sizeof(FileHeader));
+			memcpy(header.magic, FILE_MAGIC, 4);
+			header.version = FILE_VERSION;
+			header.dtype = __dtype_<T>();
+			header.little_endian = 1;
+			for (int i = 0; i < 5; i++) {
+				header.dims[i] = shape[i];
+			}
+			header.n_bytes = (unsigned long long)length() * sizeof(T);
+			if (header.dtype == DT_UNKNOWN) {
+				cerr << "Tensor::write_binary: unsupported dtype" << endl;
+				return false;
+			}
+			__swap_header_(header);
+			out.write((char*)&header, sizeof(FileHeader));
+			if (__little_endian_()) {
+				out.write((char*)data, (size_t)length() * sizeof(T));
+			}
+			else {
+				vector<char> payload((char*)data, (char*)data + (size_t)length() * sizeof(T));
+				__swap_bytes_(payload.data(), sizeof(T), length());
+				out.write(payload.data(), payload.size());
+			}
+			return (bool)out;
+		}
 
 		// serialize & deserialize
 		friend istream& operator >> (istream &in, Tensor<T> &tensor) {
 			in >> tensor.shape;
 			// re-allocate
+			tensor.__free_();
 			tensor.__allocate_();
 			tensor.foreach_assign([&](int i, int j, int k, int l, int m) {
 				T value;
@@ -903,7 +1457,7 @@ namespace tensor {
 	template<class T, class Type>
 	Tensor<T> foreach_elem(T x, Tensor<T> &y, Type func) {
 		Tensor<T> out = Tensor<T>::zeros(y.getShape());
-		out.foreach_elem_assign([&](int i) { 
+		out.foreach_elem_assign([&](auto i) { 
 			return func(x, y.get(i));
 		});
 		return out;
@@ -937,6 +1491,33 @@ namespace tensor {
 
 	template<class T>
 	void test_pooling();
+
+	template<class T>
+	void benchmark_io(int n_samples = 1000);
+
+	template<class T>
+	void benchmark_cast(int n = 1 << 24);
+
+	template<class T>
+	void benchmark_large(int n_samples = 1025, int n_channels = 1 << 21);
+
+	template<class T>
+	void benchmark_indexing(int n_samples = 64, int n_runs = 10);
+
+	template<class T>
+	void benchmark_permute(int n_samples = 64, int n_runs = 10);
+
+	template<class T>
+	void benchmark_gemm(int n_samples = 256, int n_runs = 5);
+
+	template<class T>
+	void benchmark_batch_matmul(int n_samples = 32, int n_runs = 5);
+
+	template<class T>
+	void benchmark_small_gemm(int n_samples = 178, int n_epochs = 100);
+
+	template<class T>
+	void benchmark_epilogue(int n_samples = 256, int n_runs = 5);
 }
 
 #endif // !_TENSOR_H_